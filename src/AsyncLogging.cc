@@ -4,30 +4,93 @@
 // Author: Shuo Chen (chenshuo at chenshuo dot com)
 
 #include "AsyncLogging.h"
+#include "CurrentThread.h"
 #include "LogFile.h"
+#include "ProcessInfo.h"
 #include "Timestamp.h"
 
+#include <algorithm>
+#include <iterator>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
 
 // https://blog.csdn.net/ma2595162349/article/details/102765004
 
+__thread int64_t AsyncLogging::t_stagingOwner_ = 0;
+__thread AsyncLogging::Staging* AsyncLogging::t_staging_ = NULL;
+AtomicInt64 AsyncLogging::numCreated_;
+std::atomic<AsyncLogging*> AsyncLogging::crashLogging_(NULL);
+std::atomic<bool> AsyncLogging::crashed_(false);
+
 AsyncLogging::AsyncLogging(const string& basename,
                            off_t rollSize,
-                           int flushInterval)
-	: flushInterval_(flushInterval),  // 日志落盘周期
+                           int flushInterval,
+                           int bufferSize,
+                           int poolBuffers)
+	: id_(numCreated_.incrementAndGet()),  // 区分不同实例的线程私有缓冲区
+	  flushInterval_(flushInterval),  // 日志落盘周期
 	  running_(false),                // 日志线程运行标记
 	  basename_(basename),            // 日志文件basename
 	  rollSize_(rollSize),            // 预留的日志大小
 	  thread_(std::bind(&AsyncLogging::threadFunc, this), "Logging"), // 执行该异步日志记录器的线程
 	  latch_(1),
 	  mutex_(),
-	  cond_(mutex_),
-	  currentBuffer_(new Buffer),  // 当前缓冲区
-	  nextBuffer_(new Buffer),     // 预备缓冲区
-	  buffers_()                   // 缓冲区队列
+	  backendIdle_(false),
+	  backendWakeups_(0),
+	  releaseIdleBuffers_(false),
+	  lazyRelease_(true),
+	  buffers_(),                  // 缓冲区队列
+	  threadLocal_(false),         // 默认所有线程共用currentBuffer_
+	  pool_(new BufferPool<Buffer>(bufferSize, poolBuffers + kHeldBuffers, poolBuffers + kHeldBuffers)),
+	  overflowPolicy_(kDropNewest),
+	  maxPendingBytes_(25 * static_cast<int64_t>(bufferSize)),  // 原先积压超过25个buffer就丢弃
+	  blockTimeout_(1.0),
+	  dropLevel_(Logger::WARN),
+	  pendingBytes_(0),
+	  sharedPending_(NULL),
+	  droppedBytes_(0),
+	  writtenBytes_(0),
+	  appendedBytes_(0),
+	  appendedLines_(0),
+	  rolls_(0),
+	  lastFlush_(0),
+	  stopped_(false),
+	  stopDeadline_(0),
+	  stopTimedOut_(false),
+	  reportedDroppedBytes_(0),
+	  notFull_(mutex_),
+	  ioUringDepth_(0),
+	  directIo_(false),
+	  preallocate_(false),
+	  dropCacheWindow_(0),
+	  pageCacheDropped_(0),
+	  deferred_(false),
+	  binaryFormat_(false),
+	  frameCompressionLevel_(0),
+	  rollOnRawBytes_(false),
+	  latencyReportInterval_(0),
+	  lastLatencyReport_(0),
+	  firstHandoff_(0),
+	  flushRequested_(0),
+	  flushedSeq_(0),
+	  flushed_(mutex_),
+	  crashTimeout_(0),
+	  savedFlush_(NULL)
 {
-	currentBuffer_->bzero();
-	nextBuffer_->bzero();
+	// 一行日志最长kSmallBuffer字节，buffer至少要能放下一行
+	assert(bufferSize > detail::kSmallBuffer);
+	MutexLockGuard lock(mutex_);
+	currentBuffer_ = pool_->take();  // 当前缓冲区，mmap分配，写到时才占用内存
+	nextBuffer_ = pool_->take();     // 预备缓冲区
 	buffers_.reserve(16);
 }
 
@@ -35,24 +98,551 @@ AsyncLogging::AsyncLogging(const string& basename,
 // 向缓冲区追加日志信息，一般LOG_XX会通过Logger::setOutput进行输出控制来调用该append函数
 void AsyncLogging::append(const char* logline, int len)
 {
-	MutexLockGuard lock(mutex_);
+	if (__builtin_expect(latency_ != nullptr, 0)) {
+		int64_t start = LatencyHistogram::now();
+		appendInternal(logline, len);
+		latency_[kAppendLatency].record(LatencyHistogram::now() - start);
+	} else {
+		appendInternal(logline, len);
+	}
+}
+
+void AsyncLogging::appendInternal(const char* logline, int len)
+{
+	// 后台线程跟不上时按overflowPolicy_处理，正常情况下只多一次原子读
+	if (__builtin_expect(budgetPending() + len > maxPendingBytes_, 0)
+	    && !admitOverflow(len)) {
+		return;
+	}
+	// stop()之后后台线程不会再写，不能悄悄留在buffer里
+	if (__builtin_expect(stopped_.load(std::memory_order_relaxed), 0)) {
+		droppedBytes_ += len;
+		return;
+	}
+	if (threadLocal_) {
+		appendThreadLocal(logline, len);
+		return;
+	}
+	appendShared(logline, len);
+}
+
+// 所有线程共用currentBuffer_
+void AsyncLogging::appendShared(const char* logline, int len)
+{
+	for (;;) {
+		AppendResult result;
+		{
+			int64_t lockStart = lockWaitStart();
+			MutexLockGuard lock(mutex_);
+			recordLockWait(lockStart);
+			// 前面没锁时读到的stopped_可能已经过时，stop()在mutex_里确认之后的后台线程才做最后一次收集
+			if (stopped_.load(std::memory_order_relaxed)) {
+				droppedBytes_ += len;
+				return;
+			}
+			result = append_locked(logline, len, false);
+			if (result == kAppended) {
+				appendedBytes_ += len;
+				++appendedLines_;
+				break;
+			}
+		}
+		if (result == kQueueFull) {
+			// 无锁队列满了，放开锁等后台线程取走
+			waitForQueue();
+		} else {
+			// buffer池空了，在锁外分配，其他生产者不用等这次分配
+			BufferPtr spare = pool_->take();
+			MutexLockGuard lock(mutex_);
+			stashSpare(std::move(spare));
+		}
+	}
+	wakeIdleBackend();
+}
+
+// currentBuffer_写满时先准备好换上的buffer，再交出写满的
+// allocate为false时池空了返回kNoBuffer，由调用者放开mutex_分配，状态保持不变
+AsyncLogging::AppendResult AsyncLogging::append_locked(const char* logline, int len, bool allocate)
+{
 	// 如果当前buffer还有空间，就添加到当前日志
 	if (currentBuffer_->avail() > len) {
 		currentBuffer_->append(logline, len);
 	} else {
-        // 将使用完后的buffer添加到buffers_
-		buffers_.push_back(std::move(currentBuffer_));
-
+		BufferPtr fresh;
 		if (nextBuffer_) { // 重新设置当前buffer
-			currentBuffer_ = std::move(nextBuffer_);
+			fresh = std::move(nextBuffer_);
+		} else if ((fresh = dropOldest())) {
+			// 积压太多，复用被丢弃的最旧的buffer
+		} else if (!pool_->tryTake(&fresh)) {
+			// 如果前端写入速度太快了，一下子把两块缓冲都用完了，就从buffer池里取，池也空了才分配新的buffer
+			if (!allocate) {
+				return kNoBuffer;
+			}
+			fresh = pool_->take();
+		}
+
+		int64_t full = currentBuffer_->length();
+		if (queue_) {
+			// 入队失败时currentBuffer_保持不变，其他线程也不会越过它交出后面的buffer
+			if (!queue_->tryPut(std::move(currentBuffer_))) {
+				stashSpare(std::move(fresh));
+				return kQueueFull;
+			}
 		} else {
-			currentBuffer_.reset(new Buffer); // 如果前端写入速度太快了，一下子把两块缓冲都用完了，那么只好分配一块新的buffer,作当前缓冲，这是极少发生的情况
+	        // 将使用完后的buffer添加到buffers_
+			buffers_.push_back(std::move(currentBuffer_));
 		}
-		 
-		currentBuffer_->append(logline, len);
+		addPending(full);
+		markHandoff();
+
+		currentBuffer_ = std::move(fresh);
+		if (__builtin_expect(len >= currentBuffer_->avail(), 0)) {
+			// 一个buffer都放不下的一行单独放在刚好装得下的buffer里，下次随currentBuffer_交出
+			pool_->put(std::move(currentBuffer_));
+			currentBuffer_ = makeOversized(logline, len);
+		} else {
+			currentBuffer_->append(logline, len);
+		}
+
+		// 通知日志线程，有数据可写，日志线程醒着时不进内核
+		wakeup_.notify();
+	}
+	return kAppended;
+}
+
+// 暂时用不上的空buffer，留作nextBuffer_或者还给池
+void AsyncLogging::stashSpare(BufferPtr spare)
+{
+	if (!nextBuffer_) {
+		nextBuffer_ = std::move(spare);
+	} else {
+		pool_->put(std::move(spare));
+	}
+}
+
+// 写入本线程私有的缓冲区，只有缓冲区写满时才需要加全局锁mutex_
+void AsyncLogging::appendThreadLocal(const char* logline, int len)
+{
+	Staging* staging = threadStaging();
+	BufferPtr full;
+	bool reserved = false;
+	{
+		int64_t lockStart = lockWaitStart();
+		MutexLockGuard lock(staging->mutex);
+		recordLockWait(lockStart);
+		if (stopped_.load(std::memory_order_relaxed)) {
+			droppedBytes_ += len;
+			return;
+		}
+		if (staging->reserved) {
+			// 本线程正在往预留的空间里写，不能挪动它后面的位置
+			reserved = true;
+		} else if (staging->buffer->avail() > len) {
+			staging->buffer->append(logline, len);
+			staging->appendedBytes += len;
+			++staging->appendedLines;
+		} else {
+			// 先把写满的buffer摘下来，此时staging->buffer为空，后台线程收集时会跳过
+			full = std::move(staging->buffer);
+			staging->handingOff = true;
+			staging->handingOffBytes = full->length();
+		}
+	}
+	if (reserved) {
+		appendShared(logline, len);
+		return;
+	}
+	if (!full) {
+		wakeIdleBackend();
+		return;
+	}
+
+	BufferPtr fresh = handOff(std::move(full));
+	if (__builtin_expect(len >= fresh->avail(), 0)) {
+		// 一个buffer都放不下的一行单独放在刚好装得下的buffer里，紧跟着交出去
+		pool_->put(handOff(makeOversized(logline, len)));
+	} else {
+		fresh->append(logline, len);
+	}
+
+	// 写满的buffer入队之后才写入新日志，保证同一线程的日志顺序
+	// handingOff期间stop()在等，这一行一定会被最后一次收集取走
+	MutexLockGuard lock(staging->mutex);
+	staging->buffer = std::move(fresh);
+	staging->handingOff = false;
+	if (staging->abandoned) {
+		// stop()没等到，这个buffer不会再被收集
+		droppedBytes_ += len;
+		return;
+	}
+	staging->appendedBytes += len;
+	++staging->appendedLines;
+}
+
+// 把从线程私有缓冲区摘下来的写满的buffer交给后台线程，返回换来的空buffer
+AsyncLogging::BufferPtr AsyncLogging::handOff(BufferPtr full)
+{
+	// 两把锁从不嵌套持有，避免和collectStagings()死锁
+	BufferPtr fresh;
+	int64_t fullBytes = full->length();
+	if (queue_) {
+		// 全程不碰mutex_
+		while (!queue_->tryPut(std::move(full))) {
+			waitForQueue();
+		}
+		addPending(fullBytes);
+		markHandoff();
+		fresh = dropOldest();
+		if (!fresh) {
+			fresh = pool_->take();
+		}
+		wakeup_.notify();
+	} else {
+		int64_t lockStart = lockWaitStart();
+		MutexLockGuard lock(mutex_);
+		recordLockWait(lockStart);
+		buffers_.push_back(std::move(full));
+		addPending(fullBytes);
+		markHandoff();
+		if (nextBuffer_) {
+			fresh = std::move(nextBuffer_);
+		} else if (!(fresh = dropOldest())) {
+			pool_->tryTake(&fresh);
+		}
+		wakeup_.notify();
+	}
+	if (!fresh) {
+		// 池空了，在锁外分配
+		fresh = pool_->take();
+	}
+	return fresh;
+}
+
+char* AsyncLogging::reserve(int maxLen)
+{
+	if (!threadLocal_ || stopped_.load(std::memory_order_relaxed)) {
+		return NULL;
+	}
+	Staging* staging = threadStaging();
+	BufferPtr full;
+	{
+		int64_t lockStart = lockWaitStart();
+		MutexLockGuard lock(staging->mutex);
+		recordLockWait(lockStart);
+		if (staging->reserved || stopped_.load(std::memory_order_relaxed)) {
+			return NULL;
+		}
+		if (staging->buffer->avail() > maxLen) {
+			staging->reserved = true;
+			return staging->buffer->current();
+		}
+		full = std::move(staging->buffer);
+		staging->handingOff = true;
+		staging->handingOffBytes = full->length();
+	}
+
+	BufferPtr fresh = handOff(std::move(full));
+	MutexLockGuard lock(staging->mutex);
+	staging->buffer = std::move(fresh);
+	staging->handingOff = false;
+	staging->reserved = true;
+	return staging->buffer->current();
+}
+
+// 和append()一样先按overflowPolicy_决定接不接受，不接受时这段内容留在预留的位置上，之后被覆盖
+void AsyncLogging::commit(const char* data, int len)
+{
+	int64_t start = latency_ ? LatencyHistogram::now() : 0;
+	bool accepted = true;
+	if (__builtin_expect(budgetPending() + len > maxPendingBytes_, 0) && !admitOverflow(len)) {
+		accepted = false;
+	}
+
+	Staging* staging = t_staging_;
+	{
+		MutexLockGuard lock(staging->mutex);
+		assert(staging->reserved && data == staging->buffer->current());
+		(void)data;
+		// 和appendThreadLocal()一样在锁里确认，stop()之后提交的不会留在没人取的buffer里
+		if (accepted && stopped_.load(std::memory_order_relaxed)) {
+			droppedBytes_ += len;
+			accepted = false;
+		}
+		if (accepted && len > 0) {
+			staging->buffer->add(len);
+			staging->appendedBytes += len;
+			++staging->appendedLines;
+		}
+		staging->reserved = false;
+	}
+	wakeIdleBackend();
+	if (start) {
+		latency_[kAppendLatency].record(LatencyHistogram::now() - start);
+	}
+}
+
+void AsyncLogging::setBufferAllocation(const detail::BufferAllocation& alloc)
+{
+	assert(!running_);
+	MutexLockGuard lock(mutex_);
+	int capacity = pool_->capacity();
+	pool_.reset(new BufferPool<Buffer>(pool_->bufferSize(), capacity, capacity, alloc));
+	currentBuffer_ = pool_->take();
+	nextBuffer_ = pool_->take();
+}
+
+void AsyncLogging::setLockFreeQueue(int slots)
+{
+	assert(!running_);
+	queue_.reset(new BufferQueue(slots));
+}
+
 
-		// 通知日志线程，有数据可写 
-		cond_.notify();
+void AsyncLogging::setOverflowPolicy(OverflowPolicy policy, int64_t maxPendingBytes)
+{
+	assert(!running_);
+	overflowPolicy_ = policy;
+	maxPendingBytes_ = maxPendingBytes;
+}
+
+// 积压超过上限时决定这条日志还能不能写入，kDropOldest在交出buffer时处理
+bool AsyncLogging::admitOverflow(int len)
+{
+	switch (overflowPolicy_) {
+	case kDropOldest:
+		return true;
+	case kBlock:
+		if (waitForSpace(len)) {
+			return true;
+		}
+		break;
+	case kDropBelowLevel:
+		// 级别高的日志也不能让内存无限增长
+		if (Logger::outputLevel() >= dropLevel_ &&
+		    budgetPending() + len <= kHighLevelHeadroom * maxPendingBytes_) {
+			return true;
+		}
+		break;
+	case kDropNewest:
+		break;
+	}
+	droppedBytes_ += len;
+	return false;
+}
+
+namespace
+{
+
+const double kSharedBudgetPoll = 0.01;
+
+}  // namespace
+
+// 等待后台线程写完腾出空间，超过blockTimeout_秒返回false
+bool AsyncLogging::waitForSpace(int len)
+{
+	Timestamp deadline = addTime(Timestamp::now(), blockTimeout_);
+	MutexLockGuard lock(mutex_);
+	while (budgetPending() + len > maxPendingBytes_) {
+		double remain = timeDifference(deadline, Timestamp::now());
+		if (remain <= 0) {
+			return false;
+		}
+		wakeup_.notify();
+		// 共用积压上限时腾出空间的可能是其他实例的后台线程，不会通知notFull_，定时重新检查
+		notFull_.waitForSeconds(sharedPending_ && remain > kSharedBudgetPoll ? kSharedBudgetPoll : remain);
+	}
+	return true;
+}
+
+// kDropOldest且积压超过上限时，把最早交出去、后台线程还没取走的buffer丢掉，腾出来复用
+// 没有使用无锁队列时调用者必须持有mutex_
+AsyncLogging::BufferPtr AsyncLogging::dropOldest() NO_THREAD_SAFETY_ANALYSIS
+{
+	BufferPtr oldest;
+	if (overflowPolicy_ != kDropOldest || budgetPending() <= maxPendingBytes_) {
+		return oldest;
+	}
+
+	if (queue_) {
+		queue_->tryTake(&oldest);
+	} else if (!buffers_.empty()) {
+		oldest = std::move(buffers_.front());
+		buffers_.erase(buffers_.begin());
+	}
+	if (oldest) {
+		addPending(-oldest->length());
+		droppedBytes_ += oldest->length();
+		oldest->reset();
+	}
+	return oldest;
+}
+
+// 后台线程写完一批日志后扣除积压字节数，唤醒kBlock时等待的生产者
+void AsyncLogging::wakeBlocked(int64_t writtenBytes)
+{
+	addPending(-writtenBytes);
+	if (overflowPolicy_ == kBlock) {
+		MutexLockGuard lock(mutex_);
+		notFull_.notifyAll();
+	}
+}
+
+// 无锁队列已满，叫醒后台线程并让出CPU
+void AsyncLogging::waitForQueue()
+{
+	wakeup_.notify();
+	sched_yield();
+}
+
+// 获取本线程在该实例中的暂存缓冲区，第一次调用时注册
+AsyncLogging::Staging* AsyncLogging::threadStaging()
+{
+	if (__builtin_expect(t_stagingOwner_ == id_, 1)) {
+		return t_staging_;
+	}
+
+	// 本线程在这个实例中注册过，不用拿mutex_；实例id不会重复，析构了的实例只剩过期的weak_ptr
+	std::vector<std::pair<int64_t, std::weak_ptr<Staging>>>& owned = stagingOwner().stagings;
+	for (const auto& entry : owned) {
+		if (entry.first == id_ && !entry.second.expired()) {
+			t_stagingOwner_ = id_;
+			t_staging_ = entry.second.lock().get();   // stagings_持有，实例析构前一直有效
+			return t_staging_;
+		}
+	}
+
+	pid_t tid = CurrentThread::tid();
+	std::shared_ptr<Staging> staging;
+	{
+		MutexLockGuard lock(mutex_);
+		auto it = stagings_.find(tid);
+		if (it != stagings_.end()) {
+			// 本线程注册过，或者同一tid的旧线程已经结束，还没有回收
+			staging = it->second;
+			MutexLockGuard stagingLock(staging->mutex);
+			staging->exited = false;
+		}
+	}
+	if (!staging) {
+		// 只有本线程会注册这个tid，buffer可能要分配，不在mutex_里做
+		staging.reset(new Staging);
+		BufferPtr buffer = pool_->take();
+		{
+			MutexLockGuard stagingLock(staging->mutex);
+			staging->buffer = std::move(buffer);
+		}
+		MutexLockGuard lock(mutex_);
+		stagings_[tid] = staging;
+	}
+	// 顺便去掉已经析构的实例的
+	owned.erase(std::remove_if(owned.begin(), owned.end(),
+	                           [](const std::pair<int64_t, std::weak_ptr<Staging>>& p) { return p.second.expired(); }),
+	            owned.end());
+	owned.push_back(std::make_pair(id_, std::weak_ptr<Staging>(staging)));
+	t_stagingOwner_ = id_;
+	t_staging_ = staging.get();
+	return t_staging_;
+}
+
+AsyncLogging::StagingOwner& AsyncLogging::stagingOwner()
+{
+	static thread_local StagingOwner owner;
+	return owner;
+}
+
+size_t AsyncLogging::threadStagings()
+{
+	const std::vector<std::pair<int64_t, std::weak_ptr<Staging>>>& owned = stagingOwner().stagings;
+	return std::count_if(owned.begin(), owned.end(),
+	                     [](const std::pair<int64_t, std::weak_ptr<Staging>>& p) { return !p.second.expired(); });
+}
+
+AsyncLogging::StagingOwner::~StagingOwner()
+{
+	for (const auto& entry : stagings) {
+		std::shared_ptr<Staging> staging = entry.second.lock();
+		if (staging) {
+			MutexLockGuard lock(staging->mutex);
+			staging->exited = true;
+		}
+	}
+}
+
+// 回收所属线程已经结束、日志都已取走的暂存缓冲区，buffer归还给池，计数并入appendedBytes_
+// 线程频繁创建、退出时stagings_和后台线程每轮的扫描不会一直增长
+void AsyncLogging::reapStagings()
+{
+	auto it = stagings_.begin();
+	while (it != stagings_.end()) {
+		Staging* staging = it->second.get();
+		bool dead = false;
+		{
+			MutexLockGuard lock(staging->mutex);
+			if (staging->exited && !staging->reserved &&
+			    (!staging->buffer || staging->buffer->length() == 0)) {
+				appendedBytes_ += staging->appendedBytes;
+				appendedLines_ += staging->appendedLines;
+				if (staging->buffer) {
+					pool_->put(std::move(staging->buffer));
+				}
+				dead = true;
+			}
+		}
+		it = dead ? stagings_.erase(it) : std::next(it);
+	}
+}
+
+// stopped_已经为true，之后拿到mutex_或Staging::mutex的生产者都会看到它
+// 这里等已经在锁里的生产者出来，并等正在交出写满buffer、正在reserve()和commit()之间的线程做完，
+// 后台线程的最后一次收集才不会漏掉，collectStagings()会跳过reserved的缓冲区
+// reserve()之后还在执行用户代码(LOG_INFO << slowCall())的线程最多等到stopDeadline_，
+// 之后它已经提交的和正在交出的日志计入丢弃，标记为abandoned，报告timedOut
+void AsyncLogging::waitForProducers()
+{
+	std::vector<std::shared_ptr<Staging>> stagings;
+	{
+		MutexLockGuard lock(mutex_);
+		for (const auto& item : stagings_) {
+			stagings.push_back(item.second);
+		}
+	}
+	for (const auto& staging : stagings) {
+		for (;;) {
+			{
+				MutexLockGuard lock(staging->mutex);
+				if (!staging->handingOff && !staging->reserved) {
+					break;
+				}
+				int64_t deadline = stopDeadline_;
+				if (deadline > 0 && Timestamp::now().microSecondsSinceEpoch() >= deadline) {
+					// 正在交出的buffer若赶在最后一次收集之前入队，会被写入但仍按丢弃计
+					int64_t bytes = staging->handingOff ? staging->handingOffBytes : 0;
+					if (staging->buffer) {
+						bytes += staging->buffer->length();
+					}
+					droppedBytes_ += bytes;
+					staging->abandoned = true;
+					stopTimedOut_ = true;
+					break;
+				}
+			}
+			::sched_yield();
+		}
+	}
+}
+
+// 后台线程把各线程缓冲区中未写满的日志拷贝到currentBuffer_
+void AsyncLogging::collectStagings()
+{
+	for (const auto& item : stagings_) {
+		Staging* staging = item.second.get();
+		MutexLockGuard lock(staging->mutex);
+		// 预留着的buffer下次再收集，这个线程之后的日志也都还在里面
+		if (staging->buffer && staging->buffer->length() > 0 && !staging->reserved && !staging->abandoned) {
+			// 后台线程在这里，没有无锁队列，池空时只好在锁里分配
+			append_locked(staging->buffer->data(), staging->buffer->length(), true);
+			staging->buffer->reset();
+		}
 	}
 }
 
@@ -62,11 +652,23 @@ void AsyncLogging::threadFunc()
 {
 	assert(running_ == true);
 	latch_.countDown();
-	LogFile output(basename_, rollSize_, false);
-	BufferPtr newBuffer1(new Buffer); // 这两个是后台线程的buffer
-	BufferPtr newBuffer2(new Buffer);
-	newBuffer1->bzero();
-	newBuffer2->bzero();
+	FileUtil::AppendOptions options;
+	options.ioUringDepth = ioUringDepth_;
+	options.direct = directIo_;
+	options.preallocate = preallocate_ ? rollSize_ : 0;
+	options.dropCacheWindow = dropCacheWindow_;
+	options.release = std::bind(&AsyncLogging::releaseBuffer, this, std::placeholders::_1);
+	LogFile output(basename_, rollSize_, false, 3, 1024, options, binaryFormat_);
+	output.setCompressor(compressor_.get());
+	if (frameCompressionLevel_ > 0) {
+		output.setFrameCompression(frameCompressionLevel_, rollOnRawBytes_);
+	}
+	if (queue_) {
+		threadFuncLockFree(output);
+		return;
+	}
+	BufferPtr newBuffer1(pool_->take()); // 这两个是后台线程的buffer
+	BufferPtr newBuffer2(pool_->take());
 	BufferVector buffersToWrite;      // 保存要写入的日志，用来和前台线程的buffers_进行swap
 	buffersToWrite.reserve(16);
 	while (running_) {
@@ -74,11 +676,21 @@ void AsyncLogging::threadFunc()
 		assert(newBuffer2 && newBuffer2->length() == 0);
 		assert(buffersToWrite.empty());
 
+		// 等到有写满的buffer，或者未写满的日志已经等了flushInterval_秒，没有日志时一直睡眠
+		Buffer* spares[] = { newBuffer1.get(), newBuffer2.get() };
+		waitForWork(spares, 2);
+
+		int64_t handedOff = 0;            // 本轮取到的由生产者交出的字节数
+		int64_t flushSeq = 0;             // 本轮写完后可以回复的emergencyFlush()请求
 		{
 			MutexLockGuard lock(mutex_); // 局部锁
-			// 如果buffers_为空，那么表示没有数据需要写入文件，那么就等待指定的时间（注意这里没有用倒数计数器）
-			if (buffers_.empty()) { // unusual usage!
-				cond_.waitForSeconds(flushInterval_);   // 超时退出机制
+			flushSeq = flushRequested_;
+
+			if (threadLocal_) {
+				collectStagings();
+			}
+			for (const auto& buffer : buffers_) {
+				handedOff += buffer->length();
 			}
 
 			// 无论cond是因何而醒来，无论currentBuffer_满不满，都要将currentBuffer_放到buffers_中
@@ -96,50 +708,700 @@ void AsyncLogging::threadFunc()
 		// 从这里是没有锁，数据落盘的时候不要加锁
 		assert(!buffersToWrite.empty());
 
-		// 如果将要写入文件的buffer列表中buffer的个数大于25，那么将多余数据删除	
-		// 前端陷入死循环，拼命发送日志消息，超过后端的处理能力，会造成数据在内存中的堆积
-		// 严重时引发性能问题(可用内存不足),或程序崩溃(分配内存失败)
-		if (buffersToWrite.size() > 25) {
-			char buf[256];
-			snprintf(buf, sizeof buf, "Dropped log messages at %s, %zd larger buffers\n",
-			         Timestamp::now().toFormattedString().c_str(),
-			         buffersToWrite.size()-2);
-			fputs(buf, stderr);
-			output.append(buf, static_cast<int>(strlen(buf)));
-			buffersToWrite.erase(buffersToWrite.begin()+2, buffersToWrite.end());   // 丢掉多余日志，以腾出内存，只保留2个buffer(默认4M)
+		writeBuffers(output, buffersToWrite);
+		wakeBlocked(handedOff);
+		notifyFlushed(flushSeq);
+
+		// 前台buffer是由newBuffer1 2 归还的。buffersToWrite的buffer写完后由releaseBuffer()归还给buffer池，再从池中补齐newBuffer1 2
+		// 多出来的buffer留在池里，不再释放掉，下次突发写入时不用重新分配
+		if (!newBuffer1) {
+			newBuffer1 = pool_->take();
+		}
+		if (!newBuffer2) {
+			newBuffer2 = pool_->take();
+		}
+		buffersToWrite.clear();
+
+	}
+
+	// running_在一轮写完之后才变为false时，最后这部分日志还没有取走
+	int64_t handedOff = 0;
+	int64_t flushSeq = 0;
+	{
+		MutexLockGuard lock(mutex_);
+		flushSeq = flushRequested_;
+		if (threadLocal_) {
+			collectStagings();
+		}
+		for (const auto& buffer : buffers_) {
+			handedOff += buffer->length();
+		}
+		buffers_.push_back(std::move(currentBuffer_));
+		currentBuffer_ = std::move(newBuffer1);
+		buffersToWrite.swap(buffers_);
+	}
+	writeRemaining(output, buffersToWrite);
+	wakeBlocked(handedOff);
+	notifyFlushed(flushSeq);
+}
+
+// 无锁队列模式的后台线程：写满的buffer直接从queue_无锁取走，
+// 只有在队列为空或每隔flushInterval_秒收集未写满的buffer时才加锁
+void AsyncLogging::threadFuncLockFree(LogFile& output)
+{
+	BufferVector buffersToWrite;
+	buffersToWrite.reserve(16);
+	time_t lastCollect = ::time(NULL);
+	int64_t flushed = 0;   // 已经回复的emergencyFlush()请求
+	while (running_) {
+		waitForWork();
+
+		// 请求之前写入的日志都在队列或未写满的buffer中
+		int64_t flushSeq = flushRequested_;
+		int64_t handedOff = takeQueued(&buffersToWrite);
+		time_t now = ::time(NULL);
+		if (buffersToWrite.empty() || now - lastCollect >= flushInterval_ || !running_ || flushSeq > flushed) {
+			lastCollect = now;
+			handedOff += takePartial(&buffersToWrite);
+		}
+
+		if (!buffersToWrite.empty()) {
+			writeBuffers(output, buffersToWrite);
+			wakeBlocked(handedOff);
+			buffersToWrite.clear();
+		}
+		if (flushSeq > flushed) {
+			notifyFlushed(flushSeq);
+			flushed = flushSeq;
+		}
+	}
+
+	int64_t flushSeq = flushRequested_;
+	int64_t handedOff = takePartial(&buffersToWrite);
+	writeRemaining(output, buffersToWrite);
+	wakeBlocked(handedOff);
+	notifyFlushed(flushSeq);
+}
+
+// 后台线程在这里等待，有写满的buffer、emergencyFlush()请求或stop()时马上返回
+// 只有未写满的日志时最多等flushInterval_秒；什么都没有时设置backendIdle_后一直睡眠，
+// 由第一条新日志叫醒，空闲的进程不再每隔flushInterval_秒醒来一次
+// 先prepareWait()再检查，检查之后生产者的通知不会丢失
+void AsyncLogging::waitForWork(Buffer* const* spares, int numSpares)
+{
+	int64_t deadline = 0;   // 未写满的日志最晚写入的时间，纳秒
+	for (;;) {
+		uint32_t key = wakeup_.prepareWait();
+		backendIdle_.store(true);
+		bool ready = false;
+		bool partial = false;
+		{
+			MutexLockGuard lock(mutex_);
+			ready = !running_ || flushRequested_ != flushedSeq_ ||
+			        (queue_ ? !queue_->empty() : !buffers_.empty());
+			partial = currentBuffer_ && currentBuffer_->length() > 0;
+			reapStagings();
+			for (const auto& item : stagings_) {
+				if (partial) {
+					break;
+				}
+				Staging* staging = item.second.get();
+				MutexLockGuard stagingLock(staging->mutex);
+				partial = staging->buffer && staging->buffer->length() > 0;
+			}
+			if (!ready && !partial && releaseIdleBuffers_) {
+				releaseIdle();
+			}
+		}
+		if (!ready && !partial && releaseIdleBuffers_) {
+			pool_->releaseIdle(lazyRelease_);
+			for (int i = 0; i < numSpares; ++i) {
+				if (spares[i]) {
+					spares[i]->release(lazyRelease_);
+				}
+			}
+		}
+
+		if (ready) {
+			backendIdle_.store(false, std::memory_order_relaxed);
+			wakeup_.cancelWait();
+			return;
+		}
+		if (partial) {
+			// 已经有日志，不用生产者再叫醒
+			backendIdle_.store(false, std::memory_order_relaxed);
+			int64_t now = LatencyHistogram::now();
+			if (deadline == 0) {
+				deadline = now + static_cast<int64_t>(flushInterval_) * 1000 * 1000 * 1000;
+			}
+			if (now >= deadline) {
+				wakeup_.cancelWait();
+				return;
+			}
+			wakeup_.wait(key, static_cast<double>(deadline - now) / 1e9);
+		} else {
+			wakeup_.wait(key, -1);
+			backendIdle_.store(false, std::memory_order_relaxed);
+		}
+		backendWakeups_.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+// 后台线程将要空闲，生产者手里的空buffer写过的页交还给内核
+// 正在reserve()的线程私有缓冲区不能动
+void AsyncLogging::releaseIdle()
+{
+	if (currentBuffer_ && currentBuffer_->length() == 0) {
+		currentBuffer_->release(lazyRelease_);
+	}
+	if (nextBuffer_) {
+		nextBuffer_->release(lazyRelease_);
+	}
+	for (const auto& item : stagings_) {
+		Staging* staging = item.second.get();
+		MutexLockGuard stagingLock(staging->mutex);
+		if (staging->buffer && staging->buffer->length() == 0 && !staging->reserved) {
+			staging->buffer->release(lazyRelease_);
+		}
+	}
+}
+
+// 无锁取走队列中所有写满的buffer，返回取到的字节数
+int64_t AsyncLogging::takeQueued(BufferVector* buffers)
+{
+	int64_t bytes = 0;
+	BufferPtr buffer;
+	while (queue_->tryTake(&buffer)) {
+		bytes += buffer->length();
+		buffers->push_back(std::move(buffer));
+	}
+	return bytes;
+}
+
+// 取走未写满的buffer，为了保证同一线程的日志顺序，每次取之前都先把队列清空
+// 返回其中从队列取到的字节数
+// mutex_里只从池里取换上的buffer，池空时放开锁分配好再取一遍，其他生产者不用等分配
+int64_t AsyncLogging::takePartial(BufferVector* buffers)
+{
+	int64_t queued = 0;
+	BufferVector spares;   // 在锁外分配的buffer
+	for (;;) {
+		int missing = 0;
+		{
+			MutexLockGuard lock(mutex_);
+			for (const auto& item : stagings_) {
+				Staging* staging = item.second.get();
+				MutexLockGuard stagingLock(staging->mutex);
+				// 该线程之前交出的buffer都已经在队列里了
+				if (staging->buffer && staging->buffer->length() > 0 && !staging->reserved && !staging->abandoned) {
+					BufferPtr fresh;
+					if (!takeFresh(&spares, &fresh)) {
+						++missing;
+						continue;
+					}
+					queued += takeQueued(buffers);
+					buffers->push_back(std::move(staging->buffer));
+					staging->buffer = std::move(fresh);
+				}
+			}
+
+			// 共享模式下入队都在mutex_保护下进行，先清空队列再取currentBuffer_
+			queued += takeQueued(buffers);
+			if (currentBuffer_->length() > 0) {
+				BufferPtr fresh;
+				if (takeFresh(&spares, &fresh)) {
+					buffers->push_back(std::move(currentBuffer_));
+					currentBuffer_ = std::move(fresh);
+				} else {
+					++missing;
+				}
+			}
 		}
+		if (missing == 0) {
+			break;
+		}
+		for (int i = 0; i < missing; ++i) {
+			spares.push_back(pool_->take());
+		}
+	}
+	for (auto& spare : spares) {
+		pool_->put(std::move(spare));
+	}
+	return queued;
+}
+
+// 先用锁外分配好的spares，没有了再从池里取，池空时返回false
+bool AsyncLogging::takeFresh(BufferVector* spares, BufferPtr* fresh)
+{
+	if (!spares->empty()) {
+		*fresh = std::move(spares->back());
+		spares->pop_back();
+		return true;
+	}
+	return pool_->tryTake(fresh);
+}
 
-		// 将buffersToWrite的数据写入到日志中
+// 把buffersToWrite写入日志文件，kDropOldest时后台线程积压太多也丢弃最旧的buffer
+void AsyncLogging::writeBuffers(LogFile& output, BufferVector& buffersToWrite)
+{
+	// 前端陷入死循环，拼命发送日志消息，超过后端的处理能力，会造成数据在内存中的堆积
+	// 严重时引发性能问题(可用内存不足),或程序崩溃(分配内存失败)
+	if (overflowPolicy_ == kDropOldest) {
+		int64_t total = 0;
 		for (const auto& buffer : buffersToWrite) {
-			// FIXME: use unbuffered stdio FILE ? or use ::writev ?
-			output.append(buffer->data(), buffer->length());
+			total += buffer->length();
+		}
+		size_t n = 0;
+		// 至少保留2个buffer，用来归还给后台线程
+		while (total > maxPendingBytes_ && n + 2 < buffersToWrite.size()) {
+			total -= buffersToWrite[n]->length();
+			droppedBytes_ += buffersToWrite[n]->length();
+			pool_->put(std::move(buffersToWrite[n]));
+			++n;
+		}
+		buffersToWrite.erase(buffersToWrite.begin(), buffersToWrite.begin() + n);
+	}
+
+	// 报告上次以来丢弃的日志，前端和后台丢弃的都在这里统计
+	int64_t dropped = droppedBytes_;
+	if (dropped != reportedDroppedBytes_) {
+		char buf[256];
+		snprintf(buf, sizeof buf, "Dropped log messages at %s, %" PRId64 " bytes\n",
+		         Timestamp::now().toFormattedString().c_str(),
+		         dropped - reportedDroppedBytes_);
+		fputs(buf, stderr);
+		output.append(buf, static_cast<int>(strlen(buf)));
+		writtenBytes_ += strlen(buf);
+		reportedDroppedBytes_ = dropped;
+	}
+
+	// 延迟格式化的记录在这里变成文本，原来的buffer马上归还；二进制格式由LogFile编码
+	if (deferred_ && !binaryFormat_) {
+		BufferVector formatted;
+		for (auto& buffer : buffersToWrite) {
+			if (buffer) {
+				formatRecords(*buffer, &formatted);
+				pool_->put(std::move(buffer));
+			}
+		}
+		buffersToWrite.swap(formatted);
+	}
+
+	// 将buffersToWrite的数据用writev一次写入到日志中，不再经过stdio拷贝
+	// buffer交给writing_保管，写完成时由releaseBuffer()归还，io_uring方式下可能在之后几轮才完成
+	std::vector<struct iovec> iov;
+	iov.reserve(buffersToWrite.size());
+	int64_t bytes = 0;
+	for (auto& buffer : buffersToWrite) {
+		if (buffer->length() > 0) {
+			struct iovec vec;
+			vec.iov_base = const_cast<char*>(buffer->data());
+			vec.iov_len = buffer->length();
+			bytes += vec.iov_len;
+			iov.push_back(vec);
+			writing_[vec.iov_base] = std::move(buffer);
+		} else if (buffer) {
+			pool_->put(std::move(buffer));
+		}
+	}
+	if (latency_) {
+		int64_t handoff = firstHandoff_.exchange(0);
+		int64_t start = LatencyHistogram::now();
+		if (handoff) {
+			latency_[kWakeToWrite].record(start - handoff);
+		}
+		if (!iov.empty()) {
+			output.append(iov.data(), static_cast<int>(iov.size()));
+			int64_t written = LatencyHistogram::now();
+			latency_[kWriteLatency].record(written - start);
+			start = written;
+		}
+		output.flush();
+		latency_[kFlushLatency].record(LatencyHistogram::now() - start);
+		if (latencyReportInterval_ > 0) {
+			reportLatency(output);
+		}
+	} else {
+		if (!iov.empty()) {
+			output.append(iov.data(), static_cast<int>(iov.size()));
 		}
 		output.flush();   // 保证数据落到磁盘了
+	}
+	writtenBytes_ += bytes;
+	rolls_.store(output.rolls(), std::memory_order_relaxed);
+	lastFlush_.store(Timestamp::now().microSecondsSinceEpoch(), std::memory_order_relaxed);
+	if (dropCacheWindow_ > 0) {
+		pageCacheDropped_.store(output.droppedCacheBytes(), std::memory_order_relaxed);
+	}
+}
 
-		// 重新调整buffersToWrite的大小
-		if (buffersToWrite.size() > 2) {
-			// drop non-bzero-ed buffers, avoid trashing
-			buffersToWrite.resize(2);
+// stop()时写出最后取到的buffer，超过stopDeadline_后剩下的不再写入，计入丢弃字节数
+void AsyncLogging::writeRemaining(LogFile& output, BufferVector& buffersToWrite)
+{
+	int64_t deadline = stopDeadline_;
+	if (deadline == 0) {
+		writeBuffers(output, buffersToWrite);
+		return;
+	}
+
+	BufferVector one;
+	size_t n = 0;
+	for (; n < buffersToWrite.size() && Timestamp::now().microSecondsSinceEpoch() < deadline; ++n) {
+		one.push_back(std::move(buffersToWrite[n]));
+		writeBuffers(output, one);
+		one.clear();
+	}
+	for (; n < buffersToWrite.size(); ++n) {
+		// 没有写过的空buffer不算超时
+		if (buffersToWrite[n]->length() > 0) {
+			droppedBytes_ += buffersToWrite[n]->length();
+			stopTimedOut_ = true;
 		}
+		pool_->put(std::move(buffersToWrite[n]));
+	}
+}
 
-		// 前台buffer是由newBuffer1 2 归还的。现在把buffersToWrite的buffer归还给后台buffer
-		if (!newBuffer1) {
-			assert(!buffersToWrite.empty());
-			newBuffer1 = std::move(buffersToWrite.back());    // 复用，从buffersToWrite中弹出一个作为newBuffer1
-			buffersToWrite.pop_back();
-			newBuffer1->reset();
+// 把records中的二进制记录格式化成文本，写到从buffer池取的buffer里，追加到buffers
+void AsyncLogging::formatRecords(const Buffer& records, BufferVector* buffers)
+{
+	LogStream stream;
+	const char* p = records.data();
+	const char* end = p + records.length();
+	while (p < end) {
+		const char* data;
+		int len;
+		const char* next;
+		if (*p == Logger::kRecordMagic) {
+			stream.resetBuffer();
+			next = Logger::formatRecord(p, end, stream);
+			if (!next) {
+				fprintf(stderr, "AsyncLogging: corrupted log record, %d bytes skipped\n",
+				        static_cast<int>(end - p));
+				break;
+			}
+			data = stream.buffer().data();
+			len = stream.buffer().length();
+		} else {
+			// 普通文本行原样拷贝
+			const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+			next = eol ? eol + 1 : end;
+			data = p;
+			len = static_cast<int>(next - p);
 		}
+		p = next;
 
-		if (!newBuffer2) {
-			assert(!buffersToWrite.empty());
-			newBuffer2 = std::move(buffersToWrite.back());   // 复用，从buffersToWrite中弹出一个作为newBuffer2
-			buffersToWrite.pop_back();
-			newBuffer2->reset();
+		if (buffers->empty() || buffers->back()->avail() <= len) {
+			buffers->push_back(len < static_cast<int>(pool_->bufferSize()) ? pool_->take() : makeOversized(NULL, 0, len));
 		}
+		buffers->back()->append(data, len);
+	}
+}
 
-		buffersToWrite.clear();
+// 装下超长的一行(以及之后capacity字节)的buffer，不是池里的大小，写完后直接释放
+AsyncLogging::BufferPtr AsyncLogging::makeOversized(const char* logline, int len, int capacity)
+{
+	int size = std::max(len, capacity) + 1;
+	// O_DIRECT和io_uring按页对齐，大小也按页取整
+	size = static_cast<int>((static_cast<size_t>(size) + Buffer::kAlignment - 1) & ~(Buffer::kAlignment - 1));
+	BufferPtr buffer(new Buffer(size));
+	if (len > 0) {
+		buffer->append(logline, len);
+	}
+	return buffer;
+}
 
+// 一个buffer写入完成，归还给生产者复用，池满了就释放掉
+void AsyncLogging::releaseBuffer(const void* data)
+{
+	auto it = writing_.find(data);
+	assert(it != writing_.end());
+	pool_->put(std::move(it->second));
+	writing_.erase(it);
+}
+
+AsyncLogging::StopReport AsyncLogging::stop(double timeoutSeconds) NO_THREAD_SAFETY_ANALYSIS
+{
+	Timestamp begin = Timestamp::now();
+	disableCrashDrain();
+	int64_t written = writtenBytes_;
+	int64_t dropped = droppedBytes_;
+	if (timeoutSeconds > 0) {
+		stopDeadline_ = addTime(begin, timeoutSeconds).microSecondsSinceEpoch();
+	}
+	// 先拒绝新的日志，等已经越过检查的生产者写完，后台线程看到running_为false后再取走最后一批
+	stopped_ = true;
+	waitForProducers();
+	running_ = false;
+	wakeup_.notify();
+	thread_.join();
+	if (compressor_) {
+		compressor_->stop();
+	}
+
+	StopReport report;
+	report.flushedBytes = writtenBytes_ - written;
+	report.droppedBytes = droppedBytes_ - dropped;
+	report.timedOut = stopTimedOut_;
+	report.seconds = timeDifference(Timestamp::now(), begin);
+	return report;
+}
+
+AsyncLogging::Stats AsyncLogging::stats() const
+{
+	Stats s;
+	{
+		MutexLockGuard lock(mutex_);
+		s.appendedBytes = appendedBytes_;
+		s.appendedLines = appendedLines_;
+		for (const auto& item : stagings_) {
+			Staging* staging = item.second.get();
+			MutexLockGuard stagingLock(staging->mutex);
+			s.appendedBytes += staging->appendedBytes;
+			s.appendedLines += staging->appendedLines;
+		}
+		s.queuedBuffers = static_cast<int>(queue_ ? queue_->size() : buffers_.size());
+	}
+	s.writtenBytes = writtenBytes_;
+	s.droppedBytes = droppedBytes_;
+	s.emergencyAllocations = pool_->allocated();
+	s.pendingBytes = pendingBytes_;
+	s.rolls = rolls_.load(std::memory_order_relaxed);
+	s.lastFlush = Timestamp(lastFlush_.load(std::memory_order_relaxed));
+	s.backendWakeups = backendWakeups_.load(std::memory_order_relaxed);
+	s.hugePageAdvised = pool_->hugePageAdvised();
+	s.lockedBuffers = pool_->lockedBuffers();
+	return s;
+}
+
+void AsyncLogging::setLatencyHistograms(bool on, int reportSeconds)
+{
+	assert(!running_);
+	latency_.reset(on ? new LatencyHistogram[kNumLatencyKinds] : NULL);
+	latencyReportInterval_ = reportSeconds;
+}
+
+// 生产者交出写满的buffer，记下后台线程还没取走的最早一次
+void AsyncLogging::markHandoff()
+{
+	if (latency_) {
+		int64_t none = 0;
+		firstHandoff_.compare_exchange_strong(none, LatencyHistogram::now());
+	}
+}
+
+// 每隔latencyReportInterval_秒把各直方图写成一行日志
+void AsyncLogging::reportLatency(LogFile& output)
+{
+	static const char* const kNames[kNumLatencyKinds] = {
+		"append", "lock wait", "write", "flush", "wake to write",
+	};
+	int64_t now = LatencyHistogram::now();
+	if (lastLatencyReport_ == 0) {
+		lastLatencyReport_ = now;
+	}
+	if (now - lastLatencyReport_ < static_cast<int64_t>(latencyReportInterval_) * 1000 * 1000 * 1000) {
+		return;
+	}
+	lastLatencyReport_ = now;
+
+	string time = Timestamp::now().toFormattedString();
+	for (int i = 0; i < kNumLatencyKinds; ++i) {
+		string line = "Log latency at " + time + ", " + kNames[i] + ": " + latency_[i].snapshot().toString() + "\n";
+		output.append(line.data(), static_cast<int>(line.size()));
+		writtenBytes_ += line.size();
+	}
+}
+
+// 后台线程已经把seq之前请求的日志写入文件并flush
+void AsyncLogging::notifyFlushed(int64_t seq)
+{
+	MutexLockGuard lock(mutex_);
+	if (seq > flushedSeq_) {
+		flushedSeq_ = seq;
+		flushed_.notifyAll();
+	}
+}
+
+bool AsyncLogging::emergencyFlush(double timeoutSeconds)
+{
+	if (!running_ || CurrentThread::tid() == thread_.tid()) {
+		return false;
+	}
+	Timestamp deadline = addTime(Timestamp::now(), timeoutSeconds);
+	MutexLockGuard lock(mutex_);
+	int64_t seq = ++flushRequested_;
+	wakeup_.notify();
+	while (flushedSeq_ < seq) {
+		double remain = timeDifference(deadline, Timestamp::now());
+		if (remain <= 0) {
+			return false;
+		}
+		flushed_.waitForSeconds(remain);
+	}
+	return true;
+}
+
+namespace
+{
+
+bool passed(const struct timespec& deadline)
+{
+	struct timespec now;
+	::clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec > deadline.tv_sec ||
+	       (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec);
+}
+
+// 信号处理函数中不能阻塞在锁上，每毫秒试一次直到deadline
+bool tryLockUntil(pthread_mutex_t* mutex, const struct timespec& deadline)
+{
+	const struct timespec interval = { 0, 1000 * 1000 };
+	while (::pthread_mutex_trylock(mutex) != 0) {
+		if (passed(deadline)) {
+			return false;
+		}
+		::nanosleep(&interval, NULL);
+	}
+	return true;
+}
+
+const int kCrashSignals[] = { SIGSEGV, SIGBUS, SIGABRT };
+const int kNumCrashSignals = sizeof kCrashSignals / sizeof kCrashSignals[0];
+struct sigaction g_savedActions[kNumCrashSignals];   // enableCrashDrain()之前的处理方式
+bool g_signalsInstalled = false;
+
+void writeFully(int fd, const char* data, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = ::write(fd, data, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return;
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+}  // namespace
+
+void AsyncLogging::enableCrashDrain(double timeoutSeconds, bool handleSignals)
+{
+	assert(!running_);
+	crashTimeout_ = timeoutSeconds;
+	crashFile_ = basename_ + ".crash." + ProcessInfo::pidString() + ".log";
+	crashed_ = false;
+	AsyncLogging* expected = NULL;
+	bool enabled = crashLogging_.compare_exchange_strong(expected, this);
+	assert(enabled);
+	if (!enabled) {
+		return;
+	}
+	savedFlush_ = Logger::flushFunc();
+	Logger::setFlush(&AsyncLogging::fatalFlush);
+	if (handleSignals) {
+		// 处理一次之后恢复成原来的处理方式再重新发出，原来没有处理函数时照常结束进程、产生core
+		struct sigaction sa;
+		memset(&sa, 0, sizeof sa);
+		sa.sa_handler = &AsyncLogging::crashSignalHandler;
+		sa.sa_flags = SA_RESETHAND;
+		sigemptyset(&sa.sa_mask);
+		for (int i = 0; i < kNumCrashSignals; ++i) {
+			::sigaction(kCrashSignals[i], &sa, &g_savedActions[i]);
+		}
+		g_signalsInstalled = true;
+	}
+}
+
+// stop()之后崩溃不再处理，恢复enableCrashDrain()之前的flush函数和信号处理函数
+void AsyncLogging::disableCrashDrain()
+{
+	AsyncLogging* self = this;
+	if (!crashLogging_.compare_exchange_strong(self, NULL)) {
+		return;
+	}
+	if (g_signalsInstalled) {
+		for (int i = 0; i < kNumCrashSignals; ++i) {
+			::sigaction(kCrashSignals[i], &g_savedActions[i], NULL);
+		}
+		g_signalsInstalled = false;
+	}
+	// 之后又被别人替换过的不动
+	if (Logger::flushFunc() == &AsyncLogging::fatalFlush) {
+		Logger::setFlush(savedFlush_);
+	}
+}
+
+// LOG_FATAL在abort()之前调用
+void AsyncLogging::fatalFlush()
+{
+	AsyncLogging* log = crashLogging_;
+	if (log && log->emergencyFlush(log->crashTimeout_)) {
+		crashed_ = true;  // 都写完了，abort()产生的SIGABRT不用再处理
+	}
+	if (log && log->savedFlush_) {
+		log->savedFlush_();
+	} else {
+		fflush(stdout);
+	}
+}
+
+// 写完之后换回原来的处理方式并重新发出信号，本函数返回后由它处理
+void AsyncLogging::crashSignalHandler(int sig)
+{
+	AsyncLogging* log = crashLogging_;
+	if (log && !crashed_.exchange(true)) {
+		log->writeOnSignal();
 	}
-	output.flush();
+	for (int i = 0; i < kNumCrashSignals; ++i) {
+		if (kCrashSignals[i] == sig && g_signalsInstalled) {
+			::sigaction(sig, &g_savedActions[i], NULL);
+		}
+	}
+	::raise(sig);
 }
 
+// 在信号处理函数中把还没交给后台线程的日志按先后顺序写到crashFile_，只用async-signal-safe的系统调用
+// 拿不到锁时超时后直接读，拿到的锁不再释放，进程马上就要结束
+void AsyncLogging::writeOnSignal() NO_THREAD_SAFETY_ANALYSIS
+{
+	struct timespec deadline;
+	::clock_gettime(CLOCK_MONOTONIC, &deadline);
+	double timeout = crashTimeout_ > 0 ? crashTimeout_ : 0;
+	deadline.tv_sec += static_cast<time_t>(timeout);
+	deadline.tv_nsec += static_cast<long>((timeout - static_cast<time_t>(timeout)) * 1e9);
+	if (deadline.tv_nsec >= 1000 * 1000 * 1000) {
+		++deadline.tv_sec;
+		deadline.tv_nsec -= 1000 * 1000 * 1000;
+	}
+
+	// 崩溃的线程自己持有mutex_时直接读
+	if (!mutex_.isLockedByThisThread()) {
+		tryLockUntil(mutex_.getPthreadMutex(), deadline);
+	}
+	int fd = ::open(crashFile_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		return;
+	}
+	for (const auto& buffer : buffers_) {
+		if (buffer) {
+			writeFully(fd, buffer->data(), buffer->length());
+		}
+	}
+	if (currentBuffer_) {
+		writeFully(fd, currentBuffer_->data(), currentBuffer_->length());
+	}
+	for (const auto& item : stagings_) {
+		Staging* staging = item.second.get();
+		if (!staging->mutex.isLockedByThisThread()) {
+			tryLockUntil(staging->mutex.getPthreadMutex(), deadline);
+		}
+		if (staging->buffer) {
+			writeFully(fd, staging->buffer->data(), staging->buffer->length());
+		}
+	}
+	::fsync(fd);
+	::close(fd);
+}
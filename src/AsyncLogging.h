@@ -6,66 +6,450 @@
 #ifndef ASYNCLOGGING_H
 #define ASYNCLOGGING_H
 
+#include "Atomic.h"
 #include "BlockingQueue.h"
+#include "BufferPool.h"
 #include "CountDownLatch.h"
+#include "EventCount.h"
+#include "LatencyHistogram.h"
+#include "LockFreeQueue.h"
+#include "LogCompressor.h"
+#include "Logging.h"
 #include "Mutex.h"
 #include "Thread.h"
-#include "LogStream.h"
 
 #include <atomic>
+#include <map>
 #include <vector>
 
 
+class LogFile;
 
 class AsyncLogging : noncopyable
 {
 public:
 
+	// 后台线程处理不过来、积压的日志超过上限时的处理方式
+	enum OverflowPolicy {
+		kDropNewest,      // 丢弃新来的日志
+		kDropOldest,      // 丢弃积压最久的buffer，腾出来给新日志用
+		kBlock,           // 生产者等待后台线程写完，超时后丢弃
+		kDropBelowLevel,  // 只丢弃低于指定级别的日志，级别高的照常写入，直到积压达到上限的kHighLevelHeadroom倍
+	};
+
+	// kDropBelowLevel时不低于指定级别的日志最多可以让积压达到maxPendingBytes的这么多倍，再多也丢弃
+	static const int kHighLevelHeadroom = 2;
+
+	static const int kDefaultPoolBuffers = 4;   // 池里的空闲buffer，突发时不用临时分配
+	static const int kHeldBuffers = 4;          // 一直在用的前台currentBuffer_、nextBuffer_和后台线程的2个
+
+	// setLatencyHistograms()记录的延迟
+	enum LatencyKind {
+		kAppendLatency,    // 一次append()调用
+		kLockWait,         // append()中等待mutex_和线程私有缓冲区锁的时间
+		kWriteLatency,     // 后台线程一次LogFile::append()
+		kFlushLatency,     // 后台线程一次LogFile::flush()
+		kWakeToWrite,      // 生产者交出写满的buffer到后台线程开始写入
+		kNumLatencyKinds,
+	};
+
+	// stats()的结果，都从构造开始累计
+	struct Stats
+	{
+		int64_t appendedBytes;          // 接受的日志字节数，不包括丢弃的
+		int64_t appendedLines;          // 接受的日志条数
+		int64_t writtenBytes;           // 后台线程写入文件的字节数，deferred模式下是格式化之后的
+		int64_t droppedBytes;           // 因积压、超时或stop()之后写入而丢弃的字节数
+		int64_t emergencyAllocations;   // buffer池为空时临时分配buffer的次数
+		int queuedBuffers;              // 写满了等待后台线程取走的buffer个数
+		int64_t pendingBytes;           // 交给后台线程还没写完的字节数
+		int64_t rolls;                  // 日志文件roll的次数
+		Timestamp lastFlush;            // 后台线程最近一次flush的时间，还没有flush过时无效
+		int64_t backendWakeups;         // 后台线程睡眠后醒来的次数，没有日志时不会增加
+		int64_t hugePageAdvised;        // setBufferAllocation()之后MAP_HUGETLB成功或MADV_HUGEPAGE被接受的buffer个数，
+		                                // 透明大页是否真的用上要看/proc/self/smaps中的AnonHugePages
+		int64_t lockedBuffers;          // mlock成功的buffer个数
+	};
+
+	// stop()的结果
+	struct StopReport
+	{
+		int64_t flushedBytes;   // 调用stop()之后写入文件的字节数
+		int64_t droppedBytes;   // 调用stop()之后丢弃的字节数，包括超时没写完的和stop()期间新写入的
+		bool timedOut;          // 超过期限，有日志没有写入
+		double seconds;         // stop()花费的时间
+	};
+
+	// bufferSize为每个buffer的字节数，poolBuffers为除了kHeldBuffers个一直在用的之外预先分配的空闲buffer个数，
+	// 生产者需要新buffer时从池中取，后台线程写完后归还，池为空时在锁外临时分配
 	AsyncLogging(const string& basename,
 	             off_t rollSize,
-	             int flushInterval = 3);
+	             int flushInterval = 3,
+	             int bufferSize = detail::kLargeBuffer,
+	             int poolBuffers = kDefaultPoolBuffers);
 
 	~AsyncLogging()
 	{
 		if (running_) {
 			stop();
+		} else {
+			disableCrashDrain();
 		}
 	}
 
 	void append(const char* logline, int len);
 
+	// 零拷贝写入：在本线程的缓冲区中预留maxLen字节并返回其地址，调用者直接在其中写一条日志，
+	// 再用commit()提交实际长度，不经过append()的拷贝；配合Logger::setOutput(output, reserve, commit)
+	// 只在setThreadLocalBuffer(true)时可用，否则、stop()之后或者本线程已经预留时返回NULL，调用者改用append()
+	// 预留期间本线程append()的日志走共享的currentBuffer_，可能排在这条之前
+	char* reserve(int maxLen);
+	void commit(const char* data, int len);
+
+	// 每个生产者线程写自己的缓冲区, 写满才交给后台线程, 热路径不再竞争全局mutex_
+	// 线程结束后它的缓冲区由后台线程回收，必须在start()之前调用
+	void setThreadLocalBuffer(bool on)
+	{
+		assert(!running_);
+		threadLocal_ = on;
+	}
+
+	// 写满的buffer通过容量为slots的无锁队列交给后台线程，代替buffers_
+	// 后台线程取走写满的buffer时不加锁，必须在start()之前调用
+	void setLockFreeQueue(int slots);
+
+	// 已交给后台线程但还没写入文件的日志超过maxPendingBytes字节时按policy处理
+	// 默认kDropNewest，上限为25个大buffer，必须在start()之前调用
+	void setOverflowPolicy(OverflowPolicy policy, int64_t maxPendingBytes);
+
+	// 多个实例共用一个积压计数pending，setOverflowPolicy()的上限按pending计算，而不是本实例的积压
+	// pending由调用者拥有，必须比本实例活得久，必须在start()之前调用
+	void setSharedBudget(std::atomic<int64_t>* pending)
+	{
+		assert(!running_);
+		sharedPending_ = pending;
+	}
+
+	// 后台线程没有日志可写、将要一直睡眠时，把各个空buffer写过的页交还给内核
+	// buffer都是mmap分配的，不写不占内存，开启后很少写日志的进程只占用几KB
+	// lazy为true时用MADV_FREE，代价小但内存紧张时才从RSS中减掉，否则用MADV_DONTNEED，必须在start()之前调用
+	void setReleaseIdleBuffers(bool on, bool lazy = true)
+	{
+		assert(!running_);
+		releaseIdleBuffers_ = on;
+		lazyRelease_ = lazy;
+	}
+
+	// 重新按alloc分配buffer池，比如用大页、mlock、预先缺页，让生产者写buffer时不再缺页
+	// 预先缺页只在分配时有效，buffer池要足够大，stats()中emergencyAllocations不为0时生产者仍会分配新buffer，
+	// hugePageAdvised和lockedBuffers可以看出是否成功，必须在start()之前调用
+	void setBufferAllocation(const detail::BufferAllocation& alloc);
+
+	// kBlock时生产者最多等待的秒数
+	void setBlockTimeout(double seconds)
+	{
+		blockTimeout_ = seconds;
+	}
+
+	// 用io_uring异步写日志文件，最多同时有depth个buffer在写，写完成后才归还给buffer池
+	// 内核不支持时退回writev，poolBuffers最好不少于depth，必须在start()之前调用
+	void setIoUring(int depth)
+	{
+		assert(!running_);
+		ioUringDepth_ = depth;
+	}
+
+	// 用O_DIRECT写日志文件，不占用page cache，文件系统不支持时退回原来的方式
+	// 优先于setIoUring()，必须在start()之前调用
+	void setDirectIo(bool on)
+	{
+		assert(!running_);
+		directIo_ = on;
+	}
+
+	// roll出新文件时用fallocate预先分配rollSize字节，减少碎片和追加时分配extent的延迟
+	// 必须在start()之前调用
+	void setPreallocate(bool on)
+	{
+		assert(!running_);
+		preallocate_ = on;
+	}
+
+	// 日志文件只在page cache中保留最后window字节，之前的开始回写并在写完后丢掉，避免挤掉业务的热数据
+	// 必须在start()之前调用
+	void setDropCacheWindow(off_t window)
+	{
+		assert(!running_);
+		dropCacheWindow_ = window;
+	}
+
+	// setDropCacheWindow()之后已经从page cache中丢掉的日志字节数，可以在任意线程调用
+	int64_t pageCacheDroppedBytes() const
+	{
+		return pageCacheDropped_.load(std::memory_order_relaxed);
+	}
+
+	// 后台线程把Logger::setDeferredFormatting()产生的二进制记录格式化成文本再写入文件，
+	// 生产者线程只拷贝原始参数；混在其中的普通文本行原样写入，必须在start()之前调用
+	void setDeferredFormatting(bool on)
+	{
+		assert(!running_);
+		deferred_ = on;
+	}
+
+	// 不格式化成文本，把二进制记录编码成紧凑的二进制格式写入文件，用log_decoder还原成文本
+	// 需要同时开启Logger::setDeferredFormatting()，必须在start()之前调用
+	void setBinaryFormat(bool on)
+	{
+		assert(!running_);
+		binaryFormat_ = on;
+	}
+
+	// 后台线程把每个buffer压缩成一个独立的帧再写入文件，磁盘是瓶颈时用CPU换写入量，用log_decoder还原
+	// level为zlib压缩级别1~9，0表示不压缩；rollOnRawBytes为true时rollSize按压缩前的字节数计算
+	// 必须在start()之前调用
+	void setFrameCompression(int level, bool rollOnRawBytes = false)
+	{
+		assert(!running_);
+		frameCompressionLevel_ = level;
+		rollOnRawBytes_ = rollOnRawBytes;
+	}
+
+	// roll出的旧文件由一个低优先级线程压缩成gzip，每秒最多读入bytesPerSecond字节
+	// 当前正在写的文件不压缩，必须在start()之前调用
+	void setRolledFileCompression(bool on, int64_t bytesPerSecond = LogCompressor::kDefaultBytesPerSecond)
+	{
+		assert(!running_);
+		compressor_.reset(on ? new LogCompressor(6, bytesPerSecond) : NULL);
+	}
+
+	// 运行状态的快照，计数器都在已有的锁或者原子操作里顺带更新，可以一直开着
+	Stats stats() const;
+
+	// 本线程在还没析构的各实例中注册的暂存缓冲区个数，setThreadLocalBuffer()时每个实例最多一个
+	static size_t threadStagings();
+
+	// 记录各阶段的延迟直方图，不开启时append()只多一次判断
+	// reportSeconds大于0时后台线程每隔reportSeconds秒把直方图写入日志文件，必须在start()之前调用
+	void setLatencyHistograms(bool on, int reportSeconds = 0);
+
+	// 运行中随时可以查询，需要先开启setLatencyHistograms()
+	LatencyHistogram::Snapshot latency(LatencyKind kind) const
+	{
+		assert(latency_);
+		return latency_[kind].snapshot();
+	}
+
+	// 进程崩溃前尽量把还没写入文件的日志写出去，每次最多等待timeoutSeconds秒
+	// LOG_FATAL: 替换Logger::setFlush()，由emergencyFlush()交给后台线程写完并flush
+	// handleSignals为true时再安装SIGSEGV/SIGBUS/SIGABRT处理函数，只用open/write/fsync把
+	// 还没交给后台线程的日志写到"basename.crash.pid.log"，之后交给原来的处理函数，没有时按默认方式结束进程；
+	// 无锁队列中的buffer和后台线程正在写的部分不在其中，deferred模式下写出的是未格式化的记录
+	// 同一时间只有一个AsyncLogging可以开启，stop()时恢复原来的flush函数和信号处理函数
+	void enableCrashDrain(double timeoutSeconds, bool handleSignals);
+
+	// 把调用之前写入的日志交给后台线程写入文件并flush，等待最多timeoutSeconds秒，超时返回false
+	// 不能在后台线程和信号处理函数中调用
+	bool emergencyFlush(double timeoutSeconds);
+
+	// kDropBelowLevel时低于level的日志会被丢弃
+	void setDropLevel(Logger::LogLevel level)
+	{
+		dropLevel_ = level;
+	}
+
 	void start()
 	{
 		running_ = true;
+		if (compressor_) {
+			compressor_->start();
+		}
 		thread_.start();
 		latch_.wait();
 	}
 
-	void stop() NO_THREAD_SAFETY_ANALYSIS {
-		running_ = false;
-		cond_.notify();
-		thread_.join();
-	}
+	// 调用之前写入的日志都会写入文件，之后写入的日志丢弃并计入丢弃字节数
+	// timeoutSeconds大于0时，超过期限后剩下的buffer不再写入，也计入丢弃字节数；
+	// 后台线程正在写的一批不能中断，实际花费的时间可能稍长
+	StopReport stop(double timeoutSeconds = 0);
 
 private:
 
 	void threadFunc();
 
-	typedef detail::FixedBuffer<detail::kLargeBuffer> Buffer;
+	typedef detail::AlignedBuffer Buffer;
 	typedef std::vector<std::unique_ptr<Buffer>> BufferVector;
 	typedef BufferVector::value_type BufferPtr;
 
+	// 线程私有的暂存缓冲区, mutex只在本线程和后台线程收集时之间竞争
+	struct Staging : noncopyable {
+		Staging()
+			: reserved(false), handingOff(false), handingOffBytes(0), abandoned(false), exited(false),
+			  appendedBytes(0), appendedLines(0)
+		{ }
+
+		MutexLock mutex;
+		BufferPtr buffer GUARDED_BY(mutex);
+		bool reserved GUARDED_BY(mutex);   // reserve()之后还没有commit()，后台线程不能取走buffer
+		bool handingOff GUARDED_BY(mutex); // 写满的buffer已经摘下还没交给后台线程，stop()要等它交完
+		int64_t handingOffBytes GUARDED_BY(mutex);  // 正在交出的buffer中的字节数
+		bool abandoned GUARDED_BY(mutex);  // stop()超过期限没等到它，内容已经计入丢弃，不再收集
+		bool exited GUARDED_BY(mutex);     // 所属线程已经结束，日志取走后由reapStagings()回收
+		int64_t appendedBytes GUARDED_BY(mutex);
+		int64_t appendedLines GUARDED_BY(mutex);
+	};
+	typedef std::map<pid_t, std::shared_ptr<Staging>> StagingMap;
+
+	// 每个线程一个，线程结束时析构，把本线程在各实例中的Staging标记为exited
+	// 只持有weak_ptr，实例先析构时不会访问已经释放的Staging
+	// 同时按实例id缓存，线程在几个实例之间来回写时不用每次都拿mutex_查stagings_
+	struct StagingOwner : noncopyable {
+		~StagingOwner();
+
+		std::vector<std::pair<int64_t, std::weak_ptr<Staging>>> stagings;
+	};
+	static StagingOwner& stagingOwner();
+	typedef LockFreeQueue<BufferPtr> BufferQueue;
+
+	bool admitOverflow(int len);
+	bool waitForSpace(int len);
+	BufferPtr dropOldest();
+	void wakeBlocked(int64_t writtenBytes);
+	void appendInternal(const char* logline, int len);
+	// append_locked()的结果
+	enum AppendResult {
+		kAppended,
+		kQueueFull,   // 无锁队列已满，写满的currentBuffer_没能交出去
+		kNoBuffer,    // 没有可以换上的空buffer，要放开mutex_分配
+	};
+	AppendResult append_locked(const char* logline, int len, bool allocate) REQUIRES(mutex_);
+	void stashSpare(BufferPtr spare) REQUIRES(mutex_);
+	void appendShared(const char* logline, int len);
+	void appendThreadLocal(const char* logline, int len);
+	BufferPtr handOff(BufferPtr full);
+	BufferPtr makeOversized(const char* logline, int len, int capacity = 0);
+	Staging* threadStaging();
+	void collectStagings() REQUIRES(mutex_);
+	void reapStagings() REQUIRES(mutex_);
+	void waitForProducers() EXCLUDES(mutex_);
+	void waitForQueue();
+	void waitForWork(Buffer* const* spares = NULL, int numSpares = 0);
+	void releaseIdle() REQUIRES(mutex_);
+
+	// 和maxPendingBytes_比较的积压字节数，setSharedBudget()之后是所有实例的总和
+	int64_t budgetPending() const
+	{
+		return (sharedPending_ ? *sharedPending_ : pendingBytes_).load(std::memory_order_relaxed);
+	}
+	void addPending(int64_t bytes)
+	{
+		pendingBytes_ += bytes;
+		if (sharedPending_) {
+			*sharedPending_ += bytes;
+		}
+	}
+
+	// 后台线程因为没有日志而睡眠时才需要叫醒，否则只多一次原子读
+	void wakeIdleBackend()
+	{
+		if (backendIdle_.load(std::memory_order_relaxed) && backendIdle_.exchange(false)) {
+			wakeup_.notify();
+		}
+	}
+
+	void threadFuncLockFree(LogFile& output);
+	int64_t takeQueued(BufferVector* buffers);
+	int64_t takePartial(BufferVector* buffers);
+	bool takeFresh(BufferVector* spares, BufferPtr* fresh);
+	void writeBuffers(LogFile& output, BufferVector& buffersToWrite);
+	void writeRemaining(LogFile& output, BufferVector& buffersToWrite);
+	void releaseBuffer(const void* data);
+	void notifyFlushed(int64_t seq);
+	void markHandoff();
+	void reportLatency(LogFile& output);
+
+	// 开启延迟直方图时返回当前时间，否则返回0，用来计时等锁
+	int64_t lockWaitStart() const
+	{
+		return latency_ ? LatencyHistogram::now() : 0;
+	}
+	void recordLockWait(int64_t start)
+	{
+		if (start) {
+			latency_[kLockWait].record(LatencyHistogram::now() - start);
+		}
+	}
+	void disableCrashDrain();
+	void writeOnSignal();
+
+	static void fatalFlush();
+	static void crashSignalHandler(int sig);
+	void formatRecords(const Buffer& records, BufferVector* buffers);
+
+	const int64_t id_;
 	const int flushInterval_;
 	std::atomic<bool> running_;
 	const string basename_;
 	const off_t rollSize_;
 	Thread thread_;
 	CountDownLatch latch_;
-	MutexLock mutex_;
-	Condition cond_ GUARDED_BY(mutex_);
+	mutable MutexLock mutex_;
+	EventCount wakeup_;                       // 叫醒后台线程，后台线程醒着时notify()不进内核
+	std::atomic<bool> backendIdle_;           // 后台线程没有任何日志可写，正在无限期睡眠
+	std::atomic<int64_t> backendWakeups_;
+	bool releaseIdleBuffers_;
+	bool lazyRelease_;
 	BufferPtr currentBuffer_ GUARDED_BY(mutex_);
 	BufferPtr nextBuffer_ GUARDED_BY(mutex_);
 	BufferVector buffers_ GUARDED_BY(mutex_);
+	bool threadLocal_;
+	StagingMap stagings_ GUARDED_BY(mutex_);
+	std::unique_ptr<BufferQueue> queue_;      // 生产者 -> 后台线程，写满的buffer
+	std::unique_ptr<BufferPool<Buffer>> pool_;  // 后台线程 -> 生产者，写完回收的buffer
+	OverflowPolicy overflowPolicy_;
+	int64_t maxPendingBytes_;
+	double blockTimeout_;
+	Logger::LogLevel dropLevel_;
+	std::atomic<int64_t> pendingBytes_;       // 已交给后台线程还没写完的字节数
+	std::atomic<int64_t>* sharedPending_;     // setSharedBudget()，多个实例的积压总和
+	std::atomic<int64_t> droppedBytes_;       // 因积压丢弃的字节数
+	std::atomic<int64_t> writtenBytes_;       // 后台线程写入文件的字节数
+	int64_t appendedBytes_ GUARDED_BY(mutex_);  // 共享buffer模式下接受的日志，线程私有模式记在Staging中
+	int64_t appendedLines_ GUARDED_BY(mutex_);
+	std::atomic<int64_t> rolls_;
+	std::atomic<int64_t> lastFlush_;          // 微秒
+	std::atomic<bool> stopped_;               // 已经调用stop()，不再接受新的日志
+	std::atomic<int64_t> stopDeadline_;       // stop()的期限，微秒，0表示不限
+	bool stopTimedOut_;                       // 后台线程因超过stopDeadline_放弃了一些buffer
+	int64_t reportedDroppedBytes_;            // 后台线程已经报告过的丢弃字节数
+	Condition notFull_ GUARDED_BY(mutex_);    // kBlock时生产者在此等待
+	int ioUringDepth_;
+	bool directIo_;
+	bool preallocate_;
+	off_t dropCacheWindow_;
+	std::atomic<int64_t> pageCacheDropped_;
+	bool deferred_;
+	bool binaryFormat_;
+	int frameCompressionLevel_;
+	bool rollOnRawBytes_;
+	std::unique_ptr<LogCompressor> compressor_;
+	std::unique_ptr<LatencyHistogram[]> latency_;  // kNumLatencyKinds个
+	int latencyReportInterval_;
+	int64_t lastLatencyReport_;               // 只在后台线程访问
+	std::atomic<int64_t> firstHandoff_;       // 后台线程还没取走的最早交出buffer的时间，0表示没有
+	std::atomic<int64_t> flushRequested_;     // emergencyFlush()的请求序号
+	int64_t flushedSeq_ GUARDED_BY(mutex_);   // 后台线程已经写完的请求序号
+	Condition flushed_ GUARDED_BY(mutex_);
+	double crashTimeout_;
+	string crashFile_;
+	Logger::FlushFunc savedFlush_;            // enableCrashDrain()之前的flush函数
+	std::map<const void*, BufferPtr> writing_;  // 已提交写入还没完成的buffer，只在后台线程访问
+
+	static __thread int64_t t_stagingOwner_;   // t_staging_所属AsyncLogging的id_
+	static __thread Staging* t_staging_;
+	static AtomicInt64 numCreated_;
+	static std::atomic<AsyncLogging*> crashLogging_;  // enableCrashDrain()的实例
+	static std::atomic<bool> crashed_;                // 已经处理过崩溃，避免abort()时再做一次
 };
 
 
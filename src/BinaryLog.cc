@@ -0,0 +1,270 @@
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+#include "BinaryLog.h"
+
+#include <string.h>
+
+namespace
+{
+
+void putVarint(string* out, uint64_t v)
+{
+	char buf[10];
+	int n = 0;
+	while (v >= 0x80) {
+		buf[n++] = static_cast<char>(v | 0x80);
+		v >>= 7;
+	}
+	buf[n++] = static_cast<char>(v);
+	out->append(buf, n);
+}
+
+bool getVarint(const char** p, const char* end, uint64_t* v)
+{
+	uint64_t result = 0;
+	for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+		uint8_t byte = static_cast<uint8_t>(*(*p)++);
+		result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			*v = result;
+			return true;
+		}
+	}
+	return false;
+}
+
+inline uint64_t zigzag(int64_t v)
+{
+	return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+}
+
+inline int64_t unzigzag(uint64_t v)
+{
+	return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+}
+
+// 帧: 类型 + 内容长度 + 内容
+void putFrame(string* out, char type, const char* payload, size_t len)
+{
+	out->push_back(type);
+	putVarint(out, len);
+	out->append(payload, len);
+}
+
+}  // namespace
+
+const char BinaryLogEncoder::kFileMagic[8] = { 'M', 'D', 'B', 'L', 'O', 'G', '0', '2' };
+
+BinaryLogEncoder::BinaryLogEncoder()
+	: headerWritten_(false),
+	  recordCount_(0),
+	  baseTime_(0),
+	  lastTime_(0)
+{
+}
+
+void BinaryLogEncoder::reset()
+{
+	callsites_.clear();
+	headerWritten_ = false;
+}
+
+void BinaryLogEncoder::encode(const char* data, int len, string* out)
+{
+	if (!headerWritten_) {
+		out->append(kFileMagic, sizeof kFileMagic);
+		headerWritten_ = true;
+	}
+
+	const char* p = data;
+	const char* end = data + len;
+	while (p < end) {
+		Logger::Record r;
+		const char* next = NULL;
+		if (*p == Logger::kRecordMagic) {
+			next = Logger::parseRecord(p, end, &r);
+		}
+		if (next) {
+			addRecord(r, callsiteId(r, out));
+		} else {
+			// 文本行，先把前面的记录写出去保证顺序；损坏的记录也按文本原样保留
+			const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+			next = eol ? eol + 1 : end;
+			flushRecords(out);
+			putFrame(out, kFrameText, p, next - p);
+		}
+		p = next;
+	}
+	flushRecords(out);
+}
+
+// 第一次遇到的调用点马上写一个调用点帧，在引用它的记录帧之前
+uint32_t BinaryLogEncoder::callsiteId(const Logger::Record& r, string* out)
+{
+	std::pair<const char*, int> key(r.file.data(), r.line);
+	CallsiteMap::iterator it = callsites_.find(key);
+	if (it != callsites_.end()) {
+		return it->second;
+	}
+
+	uint32_t id = static_cast<uint32_t>(callsites_.size());
+	callsites_[key] = id;
+	string payload;
+	putVarint(&payload, id);
+	putVarint(&payload, r.line);
+	putVarint(&payload, r.file.size());
+	payload.append(r.file.data(), r.file.size());
+	putFrame(out, kFrameCallsite, payload.data(), payload.size());
+	return id;
+}
+
+void BinaryLogEncoder::addRecord(const Logger::Record& r, uint32_t callsite)
+{
+	if (recordCount_ == 0) {
+		baseTime_ = lastTime_ = r.microSecondsSinceEpoch;
+	}
+	// 多个线程的记录交错，时间差可能为负
+	putVarint(&records_, zigzag(r.microSecondsSinceEpoch - lastTime_));
+	lastTime_ = r.microSecondsSinceEpoch;
+	records_.push_back(static_cast<char>(r.level));
+	putVarint(&records_, static_cast<uint32_t>(r.tid));
+	putVarint(&records_, callsite);
+	// 参数换成和机器无关的编码，文件可以拿到字节序、long长度不同的机器上解码
+	args_.clear();
+	if (!LogStream::exportDeferred(r.args, r.argsEnd, &args_)) {
+		args_.assign(1, '\0');   // parseRecord()已经检查过，不会走到这里；保持帧完整，参数为空
+	}
+	putVarint(&records_, args_.size());
+	records_.append(args_);
+	++recordCount_;
+}
+
+void BinaryLogEncoder::flushRecords(string* out)
+{
+	if (recordCount_ == 0) {
+		return;
+	}
+	string head;
+	putVarint(&head, recordCount_);
+	putVarint(&head, baseTime_);
+	out->push_back(kFrameRecords);
+	putVarint(out, head.size() + records_.size());
+	out->append(head);
+	out->append(records_);
+	records_.clear();
+	recordCount_ = 0;
+}
+
+BinaryLogDecoder::BinaryLogDecoder()
+	: headerSeen_(false)
+{
+}
+
+bool BinaryLogDecoder::isBinaryLog(const char* data, size_t len)
+{
+	return len >= sizeof BinaryLogEncoder::kFileMagic &&
+	       memcmp(data, BinaryLogEncoder::kFileMagic, sizeof BinaryLogEncoder::kFileMagic) == 0;
+}
+
+ssize_t BinaryLogDecoder::decode(const char* data, size_t len, string* out)
+{
+	const char* p = data;
+	const char* end = data + len;
+	if (!headerSeen_) {
+		if (len < sizeof BinaryLogEncoder::kFileMagic) {
+			return 0;
+		}
+		if (!isBinaryLog(data, len)) {
+			return -1;
+		}
+		p += sizeof BinaryLogEncoder::kFileMagic;
+		headerSeen_ = true;
+	}
+
+	while (p < end) {
+		const char* frame = p;
+		char type = *p++;
+		uint64_t size = 0;
+		if (!getVarint(&p, end, &size) || static_cast<uint64_t>(end - p) < size) {
+			return frame - data;  // 不完整的帧
+		}
+		const char* payload = p;
+		const char* payloadEnd = p + size;
+		p = payloadEnd;
+
+		switch (type) {
+		case BinaryLogEncoder::kFrameCallsite: {
+			uint64_t id, line, fileLen;
+			if (!getVarint(&payload, payloadEnd, &id) ||
+			    !getVarint(&payload, payloadEnd, &line) ||
+			    !getVarint(&payload, payloadEnd, &fileLen) ||
+			    static_cast<uint64_t>(payloadEnd - payload) < fileLen ||
+			    id > callsites_.size()) {
+				return -1;
+			}
+			if (id == callsites_.size()) {
+				callsites_.push_back(Callsite());
+			}
+			callsites_[id].file.assign(payload, fileLen);
+			callsites_[id].line = static_cast<int>(line);
+			break;
+		}
+		case BinaryLogEncoder::kFrameRecords:
+			if (!decodeRecords(payload, payloadEnd, out)) {
+				return -1;
+			}
+			break;
+		case BinaryLogEncoder::kFrameText:
+			out->append(payload, size);
+			break;
+		default:
+			return -1;
+		}
+	}
+	return p - data;
+}
+
+bool BinaryLogDecoder::decodeRecords(const char* p, const char* end, string* out)
+{
+	uint64_t count, base;
+	if (!getVarint(&p, end, &count) || !getVarint(&p, end, &base)) {
+		return false;
+	}
+	int64_t time = static_cast<int64_t>(base);
+	for (uint64_t i = 0; i < count; ++i) {
+		uint64_t delta, tid, callsite, argsLen;
+		if (!getVarint(&p, end, &delta) || p >= end) {
+			return false;
+		}
+		uint8_t level = static_cast<uint8_t>(*p++);
+		if (!getVarint(&p, end, &tid) ||
+		    !getVarint(&p, end, &callsite) ||
+		    !getVarint(&p, end, &argsLen) ||
+		    static_cast<uint64_t>(end - p) < argsLen ||
+		    callsite >= callsites_.size() ||
+		    level >= Logger::NUM_LOG_LEVELS) {
+			return false;
+		}
+		time += unzigzag(delta);
+
+		Logger::Record r;
+		r.microSecondsSinceEpoch = time;
+		r.tid = static_cast<int>(tid);
+		r.level = static_cast<Logger::LogLevel>(level);
+		r.file = StringPiece(callsites_[callsite].file);
+		r.line = callsites_[callsite].line;
+		args_.clear();
+		if (!LogStream::importDeferred(p, p + argsLen, &args_)) {
+			return false;
+		}
+		r.args = args_.data();
+		r.argsEnd = args_.data() + args_.size();
+		p += argsLen;
+
+		stream_.resetBuffer();
+		Logger::formatRecord(r, stream_);
+		out->append(stream_.buffer().data(), stream_.buffer().length());
+	}
+	return true;
+}
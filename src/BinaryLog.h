@@ -0,0 +1,91 @@
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+#ifndef BINARYLOG_H
+#define BINARYLOG_H
+
+#include "Logging.h"
+#include "noncopyable.h"
+#include "Types.h"
+
+#include <map>
+#include <utility>
+#include <vector>
+
+// 紧凑的二进制日志文件格式，省掉每行约60字节的文本前缀
+//
+// 文件头: kFileMagic，8字节
+// 之后是一个个帧: 类型(1字节) + 内容长度(varint) + 内容
+//   kFrameCallsite: id, 行号, 文件名长度(均为varint) + 文件名，每个文件中每个调用点只出现一次
+//   kFrameRecords:  记录数, 基准时间(varint)，然后是每条记录:
+//                   和上一条的时间差(zigzag varint), 级别(1字节), tid, 调用点id, 参数长度(varint) + 参数
+//   kFrameText:     原样的文本行
+//
+// 时间戳、tid都是varint，同一个块内的时间差通常只要1~2字节
+// 参数是LogStream::exportDeferred()的编码，不依赖字节序和long、指针的长度，文件可以在别的机器上解码
+
+// 把Logger deferred模式的记录编码成二进制帧，混在其中的文本行编码成文本帧
+// 每个文件开始时调用reset()，调用点表只对一个文件有效
+class BinaryLogEncoder : noncopyable
+{
+public:
+	BinaryLogEncoder();
+
+	// 新文件开始，下一次encode()先写文件头，调用点重新编号
+	void reset();
+
+	// 把data中的记录和文本行编码后追加到out，每次调用产生一个记录帧
+	void encode(const char* data, int len, string* out);
+
+	static const char kFileMagic[8];
+
+	enum FrameType {
+		kFrameCallsite = 1,
+		kFrameRecords = 2,
+		kFrameText = 3,
+	};
+
+private:
+	uint32_t callsiteId(const Logger::Record& r, string* out);
+	void addRecord(const Logger::Record& r, uint32_t callsite);
+	void flushRecords(string* out);
+
+	typedef std::map<std::pair<const char*, int>, uint32_t> CallsiteMap;
+
+	CallsiteMap callsites_;    // (文件名指针, 行号) -> id
+	bool headerWritten_;
+	string records_;           // 正在编码的记录帧，不包括记录数和基准时间
+	int recordCount_;
+	int64_t baseTime_;
+	int64_t lastTime_;
+	string args_;              // 一条记录转换后的参数
+};
+
+// 把二进制日志还原成和普通模式相同的文本
+class BinaryLogDecoder : noncopyable
+{
+public:
+	BinaryLogDecoder();
+
+	// data开头是不是二进制日志的文件头
+	static bool isBinaryLog(const char* data, size_t len);
+
+	// 解码data中完整的帧，文本追加到out，返回消耗的字节数，剩下的是不完整的帧
+	// 第一次调用时data必须从文件头开始；数据损坏时返回-1
+	ssize_t decode(const char* data, size_t len, string* out);
+
+private:
+	bool decodeRecords(const char* p, const char* end, string* out);
+
+	struct Callsite {
+		string file;
+		int line;
+	};
+
+	std::vector<Callsite> callsites_;
+	bool headerSeen_;
+	LogStream stream_;
+	string args_;              // 一条记录转换回本机格式的参数
+};
+
+#endif  // BINARYLOG_H
@@ -0,0 +1,130 @@
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include "LockFreeQueue.h"
+
+#include <atomic>
+#include <memory>
+
+// 预先分配好的空闲buffer池，生产者取用，后台线程写完后归还
+// BUFFER的构造函数接受buffer大小和BUFFER::Allocation
+// 池里最多保留capacity个buffer，多余的直接释放；取不到时才new，不在锁里做大块内存分配
+template<typename BUFFER>
+class BufferPool : noncopyable
+{
+public:
+	typedef std::unique_ptr<BUFFER> BufferPtr;
+	typedef typename BUFFER::Allocation Allocation;
+
+	BufferPool(size_t bufferSize, int capacity, int prealloc, const Allocation& alloc = Allocation())
+		: free_(capacity),
+		  bufferSize_(bufferSize),
+		  capacity_(capacity),
+		  alloc_(alloc),
+		  allocated_(0),
+		  hugePageAdvised_(0),
+		  lockedBuffers_(0)
+	{
+		for (int i = 0; i < prealloc && i < capacity; ++i) {
+			free_.tryPut(create());
+		}
+	}
+
+	// 只从池里取，池为空时返回false，不分配
+	bool tryTake(BufferPtr* buffer)
+	{
+		return free_.tryTake(buffer);
+	}
+
+	// 池为空时分配一个新的buffer，不要在持有热点锁时调用
+	BufferPtr take()
+	{
+		BufferPtr buffer;
+		if (!free_.tryTake(&buffer)) {
+			buffer = create();
+			allocated_.fetch_add(1, std::memory_order_relaxed);
+		}
+		return buffer;
+	}
+
+	// 重置后放回池中，池满了或者不是池里这种大小的buffer就释放
+	void put(BufferPtr buffer)
+	{
+		buffer->reset();
+		if (static_cast<int>(free_.size()) < capacity_ && buffer->capacity() == bufferSize_) {
+			free_.tryPut(std::move(buffer));
+		}
+	}
+
+	// 池里空闲buffer写过的页交还给内核，BUFFER要有release()
+	void releaseIdle(bool lazy)
+	{
+		int n = static_cast<int>(free_.size());
+		for (int i = 0; i < n; ++i) {
+			BufferPtr buffer;
+			if (!free_.tryTake(&buffer)) {
+				break;
+			}
+			buffer->release(lazy);
+			free_.tryPut(std::move(buffer));
+		}
+	}
+
+	size_t bufferSize() const
+	{
+		return bufferSize_;
+	}
+
+	int capacity() const
+	{
+		return capacity_;
+	}
+
+	// 池里空闲的buffer个数，并发时是近似值
+	int available() const
+	{
+		return static_cast<int>(free_.size());
+	}
+
+	// 因池为空而临时分配的次数
+	int64_t allocated() const
+	{
+		return allocated_.load(std::memory_order_relaxed);
+	}
+
+	// 分配的buffer中申请大页成功(见AlignedBuffer::hugePageAdvised())的和mlock成功的个数
+	int64_t hugePageAdvised() const
+	{
+		return hugePageAdvised_.load(std::memory_order_relaxed);
+	}
+	int64_t lockedBuffers() const
+	{
+		return lockedBuffers_.load(std::memory_order_relaxed);
+	}
+
+private:
+	BufferPtr create()
+	{
+		BufferPtr buffer(new BUFFER(bufferSize_, alloc_));
+		if (buffer->hugePageAdvised()) {
+			hugePageAdvised_.fetch_add(1, std::memory_order_relaxed);
+		}
+		if (buffer->locked()) {
+			lockedBuffers_.fetch_add(1, std::memory_order_relaxed);
+		}
+		return buffer;
+	}
+
+	LockFreeQueue<BufferPtr> free_;
+	const size_t bufferSize_;
+	const int capacity_;
+	const Allocation alloc_;
+	std::atomic<int64_t> allocated_;
+	std::atomic<int64_t> hugePageAdvised_;
+	std::atomic<int64_t> lockedBuffers_;
+};
+
+#endif  // BUFFERPOOL_H
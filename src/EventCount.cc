@@ -0,0 +1,47 @@
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+#include "EventCount.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace
+{
+
+long futex(std::atomic<uint32_t>* addr, int op, uint32_t val, const struct timespec* timeout)
+{
+	return ::syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), op, val, timeout, NULL, 0);
+}
+
+}  // namespace
+
+bool EventCount::wait(uint32_t key, double seconds)
+{
+	struct timespec ts;
+	struct timespec* timeout = NULL;
+	if (seconds >= 0) {
+		ts.tv_sec = static_cast<time_t>(seconds);
+		ts.tv_nsec = static_cast<long>((seconds - static_cast<double>(ts.tv_sec)) * 1e9);
+		timeout = &ts;
+	}
+	// epoch_已经变了说明prepareWait()之后有过notify()，内核会直接返回EAGAIN
+	long ret = futex(&epoch_, FUTEX_WAIT_PRIVATE, key, timeout);
+	bool timedOut = ret < 0 && errno == ETIMEDOUT;
+	waiters_.fetch_sub(1, std::memory_order_relaxed);
+	return !timedOut;
+}
+
+void EventCount::notify()
+{
+	// 让条件成立的写操作必须在读waiters_之前对等待方可见
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (waiters_.load(std::memory_order_relaxed) > 0) {
+		epoch_.fetch_add(1, std::memory_order_release);
+		futex(&epoch_, FUTEX_WAKE_PRIVATE, INT_MAX, NULL);
+	}
+}
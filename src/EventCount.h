@@ -0,0 +1,54 @@
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+#ifndef EVENTCOUNT_H
+#define EVENTCOUNT_H
+
+#include "noncopyable.h"
+
+#include <atomic>
+
+#include <stdint.h>
+
+// 只在真正有线程睡眠时才发系统调用的通知，基于futex
+//
+// 等待方:
+//   uint32_t key = ec.prepareWait();
+//   if (条件已经满足) { ec.cancelWait(); } else { ec.wait(key, seconds); }
+// 通知方: 先让条件成立，再调用ec.notify()
+//
+// prepareWait()登记之后再检查条件，notify()让条件成立之后再看有没有登记的等待者，
+// 两边至少有一边能看到对方，不会丢失唤醒；没有等待者时notify()只有一次内存屏障和原子读
+class EventCount : noncopyable
+{
+public:
+	EventCount()
+		: epoch_(0),
+		  waiters_(0)
+	{ }
+
+	uint32_t prepareWait()
+	{
+		waiters_.fetch_add(1, std::memory_order_seq_cst);
+		// 和notify()中的屏障配对，之后对条件的检查不能提前到登记之前
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		return epoch_.load(std::memory_order_acquire);
+	}
+
+	void cancelWait()
+	{
+		waiters_.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	// 睡眠直到prepareWait()之后有notify()，seconds小于0时不超时
+	// 返回false表示超时；也可能无故返回，调用者要重新检查条件
+	bool wait(uint32_t key, double seconds);
+
+	void notify();
+
+private:
+	std::atomic<uint32_t> epoch_;   // futex字，每次唤醒加1
+	std::atomic<int> waiters_;
+};
+
+#endif  // EVENTCOUNT_H
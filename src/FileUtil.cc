@@ -4,34 +4,138 @@
 // Author: Shuo Chen (chenshuo at chenshuo dot com)
 
 #include "FileUtil.h"
+#include "IoUring.h"
 #include "Logging.h"
 
+#include <algorithm>
+#include <vector>
+
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 
 
-FileUtil::AppendFile::AppendFile(StringArg filename)
-	: fp_(::fopen(filename.c_str(), "ae")),  // 'e' for O_CLOEXEC
-	  writtenBytes_(0)
+FileUtil::AppendFile::AppendFile(StringArg filename, const AppendOptions& options)
+	: fp_(NULL),
+	  writtenBytes_(0),
+	  release_(options.release),
+	  fd_(-1),
+	  fileOffset_(0),
+	  inflight_(0),
+	  syncing_(false),
+	  dirty_(false),
+	  direct_(NULL),
+	  directLen_(0),
+	  directOffset_(0),
+	  preallocated_(false),
+	  preallocateEnd_(0),
+	  dropCacheWindow_(options.dropCacheWindow),
+	  syncedOffset_(0),
+	  droppedOffset_(0),
+	  droppedCacheBytes_(0)
 {
+	if (options.direct) {
+		void* block = NULL;
+		fd_ = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | O_DIRECT, 0666);
+		if (fd_ >= 0 && ::posix_memalign(&block, kDirectAlignment, kDirectBufferSize) == 0) {
+			direct_ = static_cast<char*>(block);
+			// 已有文件末尾不满一块的部分读回中转缓冲区，之后整块重写
+			off_t size = ::lseek(fd_, 0, SEEK_END);
+			directOffset_ = size & ~static_cast<off_t>(kDirectAlignment - 1);
+			directLen_ = size - directOffset_;
+			if (directLen_ > 0) {
+				int rfd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+				if (rfd < 0 || ::pread(rfd, direct_, directLen_, directOffset_) != static_cast<ssize_t>(directLen_)) {
+					fprintf(stderr, "AppendFile: failed to read tail block %s\n", strerror_tl(errno));
+				}
+				if (rfd >= 0) {
+					::close(rfd);
+				}
+			}
+			preallocate(fd_, options.preallocate);
+			return;
+		}
+		if (fd_ >= 0) {
+			::close(fd_);
+			fd_ = -1;
+		}
+		fprintf(stderr, "AppendFile: O_DIRECT unavailable, fall back to buffered write\n");
+	}
+
+	if (options.ioUringDepth > 0) {
+		// 多个写请求同时在途，完成顺序不确定，所以不用O_APPEND而是按偏移写
+		ring_.reset(new IoUring(options.ioUringDepth + 1));  // 多一个给fdatasync
+		// 老内核上io_uring建得起来，但每个IORING_OP_WRITE都会以-EINVAL失败
+		if (ring_->valid() && ring_->supports(IORING_OP_WRITE) && ring_->supports(IORING_OP_FSYNC)) {
+			fd_ = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+		}
+		if (fd_ >= 0) {
+			fileOffset_ = ::lseek(fd_, 0, SEEK_END);
+			syncedOffset_ = droppedOffset_ = fileOffset_;
+			pending_.resize(options.ioUringDepth);
+			for (int i = options.ioUringDepth - 1; i >= 0; --i) {
+				freeSlots_.push_back(i);
+			}
+			preallocate(fd_, options.preallocate);
+			return;
+		}
+		fprintf(stderr, "AppendFile: io_uring unavailable, fall back to writev\n");
+		ring_.reset();
+	}
+	fp_ = ::fopen(filename.c_str(), "ae");  // 'e' for O_CLOEXEC
 	assert(fp_);
 	::setbuffer(fp_, buffer_, sizeof buffer_);
-	// posix_fadvise POSIX_FADV_DONTNEED ?
+	preallocate(::fileno(fp_), options.preallocate);
+	syncedOffset_ = droppedOffset_ = ::lseek(::fileno(fp_), 0, SEEK_END);
 }
 
 FileUtil::AppendFile::~AppendFile()
 {
-	::fclose(fp_);
+	if (direct_) {
+		// 最后一块补零写出后截回真实长度
+		flushDirect();
+		releasePreallocated(fd_);
+		::close(fd_);
+		::free(direct_);
+	} else if (ring_) {
+		// 等所有在途请求完成，数据才能交还给调用者
+		while (inflight_ > 0) {
+			reap(1);
+		}
+		releasePreallocated(fd_);
+		::close(fd_);
+	} else {
+		::fflush(fp_);
+		releasePreallocated(::fileno(fp_));
+		::fclose(fp_);
+	}
 }
 
 // 将len字节logline追加写入fp_
 void FileUtil::AppendFile::append(const char* logline, const size_t len)
 {
+	if (direct_) {
+		appendDirect(logline, len);
+		writtenBytes_ += len;
+		return;
+	}
+	if (ring_) {
+		// 调用者的数据在返回后就失效，同步写到已提交的数据之后
+		writeAt(logline, len, fileOffset_);
+		fileOffset_ += len;
+		writtenBytes_ += len;
+		dirty_ = true;
+		return;
+	}
+
 	size_t n = write(logline, len);
 	size_t remain = len - n;
 	while (remain > 0) {
@@ -50,9 +154,320 @@ void FileUtil::AppendFile::append(const char* logline, const size_t len)
 	writtenBytes_ += len;
 }
 
-void FileUtil::AppendFile::flush()
+// 将iov中的数据用writev直接写入文件，每次最多IOV_MAX块，处理部分写入
+void FileUtil::AppendFile::append(const struct iovec* iov, int iovcnt)
 {
+	if (direct_) {
+		for (int i = 0; i < iovcnt; ++i) {
+			appendDirect(static_cast<const char*>(iov[i].iov_base), iov[i].iov_len);
+			writtenBytes_ += iov[i].iov_len;
+			if (release_) {
+				release_(iov[i].iov_base);
+			}
+		}
+		return;
+	}
+	if (ring_) {
+		for (int i = 0; i < iovcnt; ++i) {
+			writtenBytes_ += iov[i].iov_len;
+			submitWrite(iov[i]);
+		}
+		ring_->submit(0);
+		reap(0);
+		return;
+	}
+
+	// stdio缓冲区中还有数据时先写出去，保证先后顺序
 	::fflush(fp_);
+
+	std::vector<struct iovec> vec(iov, iov + iovcnt);
+	struct iovec* p = vec.data();
+	int remain = iovcnt;
+	size_t len = 0;
+	for (int i = 0; i < iovcnt; ++i) {
+		len += iov[i].iov_len;
+	}
+
+	while (remain > 0) {
+		ssize_t n = ::writev(::fileno(fp_), p, std::min(remain, IOV_MAX));
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "AppendFile::append() failed %s\n", strerror_tl(errno));
+			break;
+		}
+		// 跳过已经写完的块，最后一块只写了一部分时调整起始位置
+		size_t x = n;
+		while (remain > 0 && x >= p->iov_len) {
+			x -= p->iov_len;
+			++p;
+			--remain;
+		}
+		if (remain > 0) {
+			p->iov_base = static_cast<char*>(p->iov_base) + x;
+			p->iov_len -= x;
+		}
+	}
+
+	writtenBytes_ += len;
+	if (release_) {
+		for (int i = 0; i < iovcnt; ++i) {
+			release_(iov[i].iov_base);
+		}
+	}
+}
+
+void FileUtil::AppendFile::flush()
+{
+	if (direct_) {
+		flushDirect();
+		return;
+	}
+	if (!ring_) {
+		::fflush(fp_);
+		if (dropCacheWindow_ > 0) {
+			dropCache(dropCacheWindow_);
+		}
+		return;
+	}
+
+	reap(0);
+	if (dropCacheWindow_ > 0) {
+		dropCache(dropCacheWindow_);
+	}
+	// 同一时间最多一个fdatasync在途，IOSQE_IO_DRAIN保证它在之前的写完成后才执行
+	if (dirty_ && !syncing_) {
+		struct io_uring_sqe* sqe = ring_->getSqe();
+		if (sqe) {
+			sqe->opcode = IORING_OP_FSYNC;
+			sqe->fd = fd_;
+			sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+			sqe->flags = IOSQE_IO_DRAIN;
+			sqe->user_data = static_cast<uint64_t>(-1);
+			ring_->submit(0);
+			++inflight_;
+			syncing_ = true;
+			dirty_ = false;
+		}
+	}
+}
+
+// 提交一个写请求，在途请求已满时先等待完成
+void FileUtil::AppendFile::submitWrite(const struct iovec& iov)
+{
+	if (iov.iov_len == 0) {
+		if (release_) {
+			release_(iov.iov_base);
+		}
+		return;
+	}
+
+	while (freeSlots_.empty()) {
+		reap(1);
+	}
+	struct io_uring_sqe* sqe = ring_->getSqe();
+	while (sqe == NULL) {
+		reap(1);
+		sqe = ring_->getSqe();
+	}
+
+	int slot = freeSlots_.back();
+	freeSlots_.pop_back();
+	Pending& p = pending_[slot];
+	p.base = iov.iov_base;
+	p.len = iov.iov_len;
+	p.offset = fileOffset_;
+
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = fd_;
+	sqe->addr = reinterpret_cast<uint64_t>(iov.iov_base);
+	sqe->len = static_cast<uint32_t>(iov.iov_len);
+	sqe->off = fileOffset_;
+	sqe->user_data = slot;
+
+	fileOffset_ += iov.iov_len;
+	++inflight_;
+	dirty_ = true;
+}
+
+// 提交未提交的请求，waitNr大于0时至少等到waitNr个完成，然后处理所有已完成的请求
+void FileUtil::AppendFile::reap(unsigned waitNr)
+{
+	if (waitNr > 0) {
+		int ret = ring_->submit(waitNr);
+		if (ret < 0) {
+			fprintf(stderr, "AppendFile::reap() failed %s\n", strerror_tl(-ret));
+		}
+	}
+	struct io_uring_cqe cqe;
+	while (ring_->peekCqe(&cqe)) {
+		complete(static_cast<int>(cqe.user_data), cqe.res);
+	}
+}
+
+void FileUtil::AppendFile::complete(int slot, int res)
+{
+	--inflight_;
+	if (slot < 0) {
+		syncing_ = false;
+		if (res < 0) {
+			fprintf(stderr, "AppendFile::flush() failed %s\n", strerror_tl(-res));
+		}
+		return;
+	}
+
+	Pending& p = pending_[slot];
+	if (res < 0) {
+		fprintf(stderr, "AppendFile::append() failed %s\n", strerror_tl(-res));
+	} else if (static_cast<size_t>(res) < p.len) {
+		// 部分写入，剩下的同步补写
+		writeAt(static_cast<const char*>(p.base) + res, p.len - res, p.offset + res);
+	}
+	const void* base = p.base;
+	p.base = NULL;   // 空闲槽位，dropCache()据此找出在途写请求
+	freeSlots_.push_back(slot);
+	if (release_) {
+		release_(base);
+	}
+}
+
+// 中转缓冲区为空且数据地址对齐时，整块部分直接从调用者的buffer写出，其余拷贝到中转缓冲区
+void FileUtil::AppendFile::appendDirect(const char* data, size_t len)
+{
+	const size_t mask = kDirectAlignment - 1;
+	while (len > 0) {
+		if (directLen_ == 0 && (reinterpret_cast<uintptr_t>(data) & mask) == 0 && len > mask) {
+			size_t n = len & ~mask;
+			writeAt(data, n, directOffset_);
+			directOffset_ += n;
+			data += n;
+			len -= n;
+			continue;
+		}
+		size_t n = std::min(len, kDirectBufferSize - directLen_);
+		memcpy(direct_ + directLen_, data, n);
+		directLen_ += n;
+		data += n;
+		len -= n;
+		if (directLen_ == kDirectBufferSize) {
+			writeAt(direct_, directLen_, directOffset_);
+			directOffset_ += directLen_;
+			directLen_ = 0;
+		}
+	}
+}
+
+// 写出中转缓冲区中的整块，不满一块的尾部补零写出但仍留在缓冲区，下次连同新数据重写这一块
+// 补零之后马上截回真实长度，其他进程读到的和崩溃后留下的文件末尾都没有多余的零
+void FileUtil::AppendFile::flushDirect()
+{
+	const size_t mask = kDirectAlignment - 1;
+	size_t full = directLen_ & ~mask;
+	if (full > 0) {
+		writeAt(direct_, full, directOffset_);
+		directOffset_ += full;
+		directLen_ -= full;
+		memmove(direct_, direct_ + full, directLen_);
+	}
+	if (directLen_ > 0) {
+		memset(direct_ + directLen_, 0, kDirectAlignment - directLen_);
+		writeAt(direct_, kDirectAlignment, directOffset_);
+		off_t size = directOffset_ + directLen_;
+		if (::ftruncate(fd_, size) < 0) {
+			fprintf(stderr, "AppendFile: ftruncate failed %s\n", strerror_tl(errno));
+		} else if (preallocated_ && preallocateEnd_ > size) {
+			// 截断把文件末尾之后预分配的空间也释放了，重新预留
+			::fallocate(fd_, FALLOC_FL_KEEP_SIZE, size, preallocateEnd_ - size);
+		}
+	}
+}
+
+// 在文件末尾之后预留len字节，不改变文件长度，文件系统不支持时什么也不做
+void FileUtil::AppendFile::preallocate(int fd, off_t len)
+{
+	if (len <= 0) {
+		return;
+	}
+	off_t size = ::lseek(fd, 0, SEEK_END);
+	if (::fallocate(fd, FALLOC_FL_KEEP_SIZE, size, len) == 0) {
+		preallocated_ = true;
+		preallocateEnd_ = size + len;
+	} else if (errno != EOPNOTSUPP) {
+		fprintf(stderr, "AppendFile: fallocate failed %s\n", strerror_tl(errno));
+	}
+}
+
+// 截断到当前长度，释放文件末尾之后没用完的预分配空间
+void FileUtil::AppendFile::releasePreallocated(int fd)
+{
+	if (!preallocated_) {
+		return;
+	}
+	struct stat st;
+	if (::fstat(fd, &st) == 0 && ::ftruncate(fd, st.st_size) < 0) {
+		fprintf(stderr, "AppendFile: ftruncate failed %s\n", strerror_tl(errno));
+	}
+}
+
+// 对新写入的数据开始异步回写，落后写入位置window以上的部分等回写完成后丢掉page cache
+// 脏页不会被DONTNEED丢掉，所以先sync_file_range；前面已经开始回写，这里通常不用等太久
+void FileUtil::AppendFile::dropCache(off_t window)
+{
+	if (direct_) {
+		return;
+	}
+
+	int fd = ring_ ? fd_ : ::fileno(fp_);
+	off_t end;
+	if (ring_) {
+		// 只处理已经写完的部分，在途写请求之后的不碰
+		end = fileOffset_;
+		for (const Pending& p : pending_) {
+			if (p.base && p.offset < end) {
+				end = p.offset;
+			}
+		}
+	} else {
+		end = ::lseek(fd, 0, SEEK_END);
+	}
+
+	if (end > syncedOffset_) {
+		::sync_file_range(fd, syncedOffset_, end - syncedOffset_, SYNC_FILE_RANGE_WRITE);
+		syncedOffset_ = end;
+	}
+
+	static const off_t kPageSize = ::sysconf(_SC_PAGESIZE);
+	off_t dropEnd = (end - window) / kPageSize * kPageSize;
+	if (dropEnd > droppedOffset_) {
+		off_t len = dropEnd - droppedOffset_;
+		::sync_file_range(fd, droppedOffset_, len,
+		                  SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+		// 只丢新回写完的部分；跨过上次边界的大页(folio)上次丢不掉，从边界所在的2MB往前补一次
+		static const off_t kFolioSize = 2 * 1024 * 1024;
+		off_t dropBegin = droppedOffset_ / kFolioSize * kFolioSize;
+		::posix_fadvise(fd, dropBegin, dropEnd - dropBegin, POSIX_FADV_DONTNEED);
+		droppedCacheBytes_ += len;
+		droppedOffset_ = dropEnd;
+	}
+}
+
+// 同步把数据写到指定偏移，处理部分写入
+void FileUtil::AppendFile::writeAt(const char* data, size_t len, off_t offset)
+{
+	while (len > 0) {
+		ssize_t n = ::pwrite(fd_, data, len, offset);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "AppendFile::append() failed %s\n", strerror_tl(errno));
+			break;
+		}
+		data += n;
+		len -= n;
+		offset += n;
+	}
 }
 
 size_t FileUtil::AppendFile::write(const char* logline, size_t len)
@@ -12,6 +12,12 @@
 #include "StringPiece.h"
 #include <sys/types.h>  // for off_t
 
+#include <functional>
+#include <memory>
+#include <vector>
+
+struct iovec;
+class IoUring;
 
 namespace FileUtil
 {
@@ -61,16 +67,48 @@ int readFile(StringArg filename,
 	return file.readToString(maxSize, content, fileSize, modifyTime, createTime);
 }
 
+// AppendFile的可选写入方式，默认和原来一样经过stdio缓冲区
+struct AppendOptions
+{
+	AppendOptions()
+		: ioUringDepth(0),
+		  direct(false),
+		  preallocate(0),
+		  dropCacheWindow(0)
+	{ }
+
+	// 大于0时append(iov)通过io_uring异步提交，最多同时有ioUringDepth个写请求在途
+	// 内核不支持io_uring或者不支持IORING_OP_WRITE(5.6之前)时退回writev
+	int ioUringDepth;
+	// 用O_DIRECT按4KB对齐的块同步写入，不占用page cache，优先于ioUringDepth
+	// 未满一块的尾部在flush时补零写出，随即截断为真实长度，读者看不到补的零；文件系统不支持时退回stdio
+	bool direct;
+	// 大于0时打开文件后用fallocate(FALLOC_FL_KEEP_SIZE)预先分配这么多字节，追加时不再分配extent
+	// 关闭文件时截断到真实长度，释放没用完的部分
+	off_t preallocate;
+	// 大于0时每次flush用sync_file_range开始回写新数据，并把落后写入位置超过这么多字节的部分
+	// 等回写完成后用POSIX_FADV_DONTNEED从page cache中丢掉；O_DIRECT方式不需要
+	off_t dropCacheWindow;
+	// append(iov)中的一块数据不再被使用时调用，参数是iov_base
+	// writev方式写完立即调用，io_uring方式在写请求完成时调用
+	std::function<void (const void*)> release;
+};
+
 // not thread safe
 class AppendFile : noncopyable
 {
 public:
-	explicit AppendFile(StringArg filename);
+	explicit AppendFile(StringArg filename, const AppendOptions& options = AppendOptions());
 
 	~AppendFile();
 
 	void append(const char* logline, size_t len);
 
+	// 用writev把iovcnt块数据一次写入文件，不经过stdio缓冲区
+	// io_uring方式下只是提交，数据要保持有效直到options.release被调用
+	void append(const struct iovec* iov, int iovcnt);
+
+	// io_uring方式下收割已完成的写请求，并异步提交一次fdatasync
 	void flush();
 
 	off_t writtenBytes() const
@@ -78,13 +116,62 @@ public:
 		return writtenBytes_;
 	}
 
+	// 把落后写入位置window字节以上、已经写完的数据从page cache中丢掉
+	void dropCache(off_t window);
+
+	// 已经从page cache中丢掉的字节数
+	off_t droppedCacheBytes() const
+	{
+		return droppedCacheBytes_;
+	}
+
 private:
 
 	size_t write(const char* logline, size_t len);
 
-	FILE* fp_;              //文件流句柄
+	// io_uring方式
+	struct Pending {
+		const void* base;
+		size_t len;
+		off_t offset;
+	};
+	void submitWrite(const struct iovec& iov);
+	void reap(unsigned waitNr);
+	void complete(int slot, int res);
+	void writeAt(const char* data, size_t len, off_t offset);
+	void preallocate(int fd, off_t len);
+	void releasePreallocated(int fd);
+
+	// O_DIRECT方式
+	void appendDirect(const char* data, size_t len);
+	void flushDirect();
+	static const size_t kDirectAlignment = 4096;
+	static const size_t kDirectBufferSize = 256*1024;
+
+	FILE* fp_;              //文件流句柄，io_uring方式下为NULL
 	char buffer_[64*1024];  //文件流的缓冲区
 	off_t writtenBytes_;    //写入字节数
+	std::function<void (const void*)> release_;
+
+	std::unique_ptr<IoUring> ring_;
+	int fd_;                       //io_uring方式下的文件描述符，不带O_APPEND，按偏移写
+	off_t fileOffset_;             //下一次写入的文件偏移
+	std::vector<Pending> pending_; //在途写请求，下标即user_data
+	std::vector<int> freeSlots_;
+	int inflight_;                 //在途请求个数，包括fdatasync
+	bool syncing_;                 //有fdatasync在途
+	bool dirty_;                   //上次fdatasync之后有新的写入
+
+	char* direct_;                 //O_DIRECT方式下对齐的中转缓冲区，其他方式为NULL
+	size_t directLen_;             //中转缓冲区中的有效字节数
+	off_t directOffset_;           //中转缓冲区对应的文件偏移，按kDirectAlignment对齐
+	bool preallocated_;
+	off_t preallocateEnd_;         //预分配到的文件偏移，O_DIRECT截断尾部后重新预分配到这里
+
+	const off_t dropCacheWindow_;
+	off_t syncedOffset_;           //已经开始回写的位置
+	off_t droppedOffset_;          //已经丢掉page cache的位置
+	off_t droppedCacheBytes_;
 };
 
 }  // namespace FileUtil
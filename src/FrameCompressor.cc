@@ -0,0 +1,151 @@
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+#include "FrameCompressor.h"
+
+#include <assert.h>
+#include <string.h>
+#include <zlib.h>
+
+namespace
+{
+
+void putUint32(char* p, uint32_t v)
+{
+	p[0] = static_cast<char>(v);
+	p[1] = static_cast<char>(v >> 8);
+	p[2] = static_cast<char>(v >> 16);
+	p[3] = static_cast<char>(v >> 24);
+}
+
+uint32_t getUint32(const char* p)
+{
+	const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+	return static_cast<uint32_t>(u[0]) |
+	       static_cast<uint32_t>(u[1]) << 8 |
+	       static_cast<uint32_t>(u[2]) << 16 |
+	       static_cast<uint32_t>(u[3]) << 24;
+}
+
+}  // namespace
+
+const char FrameCompressor::kFrameMagic[4] = { 'M', 'D', 'Z', '1' };
+
+FrameCompressor::FrameCompressor(int level)
+	: stream_(new z_stream)
+{
+	memset(stream_.get(), 0, sizeof(z_stream));
+	// 原始deflate数据，不要zlib头尾，校验由帧头的crc32负责
+	int ret = ::deflateInit2(stream_.get(), level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+	assert(ret == Z_OK); (void)ret;
+}
+
+FrameCompressor::~FrameCompressor()
+{
+	::deflateEnd(stream_.get());
+}
+
+void FrameCompressor::compress(const char* data, size_t len, string* out)
+{
+	// 超过kMaxFrameSize的数据分成多个帧
+	do {
+		size_t n = len < kMaxFrameSize ? len : kMaxFrameSize;
+		compressFrame(data, n, out);
+		data += n;
+		len -= n;
+	} while (len > 0);
+}
+
+void FrameCompressor::compressFrame(const char* data, size_t len, string* out)
+{
+	size_t start = out->size();
+	size_t bound = ::deflateBound(stream_.get(), static_cast<uLong>(len));
+	out->resize(start + kHeaderSize + bound);
+
+	char* header = &(*out)[start];
+	::deflateReset(stream_.get());
+	stream_->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+	stream_->avail_in = static_cast<uInt>(len);
+	stream_->next_out = reinterpret_cast<Bytef*>(header + kHeaderSize);
+	stream_->avail_out = static_cast<uInt>(bound);
+	int ret = ::deflate(stream_.get(), Z_FINISH);
+	assert(ret == Z_STREAM_END); (void)ret;
+	uint32_t compressedLen = static_cast<uint32_t>(bound - stream_->avail_out);
+
+	memcpy(header, kFrameMagic, sizeof kFrameMagic);
+	putUint32(header + 4, static_cast<uint32_t>(len));
+	putUint32(header + 8, compressedLen);
+	putUint32(header + 12, static_cast<uint32_t>(::crc32(0, reinterpret_cast<const Bytef*>(data),
+	                                                     static_cast<uInt>(len))));
+	out->resize(start + kHeaderSize + compressedLen);
+}
+
+FrameDecompressor::FrameDecompressor()
+	: stream_(new z_stream),
+	  corruptFrames_(0)
+{
+	memset(stream_.get(), 0, sizeof(z_stream));
+	int ret = ::inflateInit2(stream_.get(), -MAX_WBITS);
+	assert(ret == Z_OK); (void)ret;
+}
+
+FrameDecompressor::~FrameDecompressor()
+{
+	::inflateEnd(stream_.get());
+}
+
+bool FrameDecompressor::isCompressed(const char* data, size_t len)
+{
+	return len >= sizeof FrameCompressor::kFrameMagic &&
+	       memcmp(data, FrameCompressor::kFrameMagic, sizeof FrameCompressor::kFrameMagic) == 0;
+}
+
+size_t FrameDecompressor::decompress(const char* data, size_t len, string* out)
+{
+	const char* p = data;
+	const char* end = data + len;
+	while (static_cast<size_t>(end - p) >= FrameCompressor::kHeaderSize) {
+		uint32_t rawLen = getUint32(p + 4);
+		uint32_t compressedLen = getUint32(p + 8);
+		if (isCompressed(p, end - p) &&
+		    rawLen <= FrameCompressor::kMaxFrameSize &&
+		    compressedLen <= FrameCompressor::kMaxFrameSize) {
+			const char* payload = p + FrameCompressor::kHeaderSize;
+			if (static_cast<size_t>(end - payload) < compressedLen) {
+				break;  // 不完整的帧
+			}
+			if (decompressFrame(payload, compressedLen, rawLen, getUint32(p + 12), out)) {
+				p = payload + compressedLen;
+				continue;
+			}
+		}
+
+		// 帧头或内容损坏，向后找下一个帧头，找不到时留下末尾可能是帧头开头的几个字节
+		++corruptFrames_;
+		++p;
+		while (static_cast<size_t>(end - p) >= sizeof FrameCompressor::kFrameMagic &&
+		       !isCompressed(p, end - p)) {
+			++p;
+		}
+	}
+	return p - data;
+}
+
+bool FrameDecompressor::decompressFrame(const char* payload, uint32_t compressedLen,
+                                        uint32_t rawLen, uint32_t crc, string* out)
+{
+	size_t start = out->size();
+	out->resize(start + rawLen);
+	::inflateReset(stream_.get());
+	stream_->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(payload));
+	stream_->avail_in = compressedLen;
+	stream_->next_out = reinterpret_cast<Bytef*>(&(*out)[start]);
+	stream_->avail_out = rawLen;
+	int ret = ::inflate(stream_.get(), Z_FINISH);
+	if (ret != Z_STREAM_END || stream_->avail_out != 0 ||
+	    ::crc32(0, reinterpret_cast<const Bytef*>(out->data() + start), rawLen) != crc) {
+		out->resize(start);
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,68 @@
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+#ifndef FRAMECOMPRESSOR_H
+#define FRAMECOMPRESSOR_H
+
+#include "noncopyable.h"
+#include "Types.h"
+
+#include <memory>
+
+typedef struct z_stream_s z_stream;
+
+// 写入文件前把每块数据压缩成一个独立的帧，磁盘是瓶颈时用后台线程的CPU换写入量
+//
+// 帧: 帧头16字节 + zlib(deflate)压缩后的数据
+//   kFrameMagic(4字节), 原始长度, 压缩后长度, 原始数据的crc32(均为4字节小端)
+//
+// 帧之间互不依赖，进程崩溃时最多丢失最后一个没写完的帧；
+// 中间某个帧损坏时跳到下一个帧头继续，只丢失这一帧
+class FrameCompressor : noncopyable
+{
+public:
+	// level为zlib压缩级别1~9，默认最快
+	explicit FrameCompressor(int level = 1);
+	~FrameCompressor();
+
+	// 把data压缩成帧追加到out，超过kMaxFrameSize时分成多个帧
+	void compress(const char* data, size_t len, string* out);
+
+	static const char kFrameMagic[4];
+	static const int kHeaderSize = 16;
+	static const uint32_t kMaxFrameSize = 64 * 1024 * 1024;
+
+private:
+	void compressFrame(const char* data, size_t len, string* out);
+
+	std::unique_ptr<z_stream> stream_;
+};
+
+// 把FrameCompressor写出的帧还原
+class FrameDecompressor : noncopyable
+{
+public:
+	FrameDecompressor();
+	~FrameDecompressor();
+
+	// data开头是不是一个帧头
+	static bool isCompressed(const char* data, size_t len);
+
+	// 解压data中完整的帧，追加到out，返回消耗的字节数，剩下的是不完整的帧
+	// 损坏的帧跳过，数量记在corruptFrames()
+	size_t decompress(const char* data, size_t len, string* out);
+
+	int64_t corruptFrames() const
+	{
+		return corruptFrames_;
+	}
+
+private:
+	bool decompressFrame(const char* payload, uint32_t compressedLen,
+	                     uint32_t rawLen, uint32_t crc, string* out);
+
+	std::unique_ptr<z_stream> stream_;
+	int64_t corruptFrames_;
+};
+
+#endif  // FRAMECOMPRESSOR_H
@@ -0,0 +1,177 @@
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+#include "IoUring.h"
+
+#include <memory>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+
+IoUring::IoUring(unsigned entries)
+	: fd_(-1),
+	  sqEntries_(0),
+	  sqRing_(MAP_FAILED),
+	  sqRingSize_(0),
+	  cqRing_(MAP_FAILED),
+	  cqRingSize_(0),
+	  sqes_(static_cast<struct io_uring_sqe*>(MAP_FAILED)),
+	  sqesSize_(0),
+	  sqeHead_(0),
+	  sqeTail_(0)
+{
+#ifdef __NR_io_uring_setup
+	struct io_uring_params p;
+	memset(&p, 0, sizeof p);
+	int fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &p));
+	if (fd < 0) {
+		return;
+	}
+
+	sqRingSize_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cqRingSize_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	// 新内核上SQ和CQ共用一次mmap
+	bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+	if (single) {
+		sqRingSize_ = cqRingSize_ = sqRingSize_ > cqRingSize_ ? sqRingSize_ : cqRingSize_;
+	}
+
+	sqRing_ = ::mmap(NULL, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                 fd, IORING_OFF_SQ_RING);
+	if (sqRing_ == MAP_FAILED) {
+		::close(fd);
+		return;
+	}
+	if (single) {
+		cqRing_ = sqRing_;
+	} else {
+		cqRing_ = ::mmap(NULL, cqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		                 fd, IORING_OFF_CQ_RING);
+		if (cqRing_ == MAP_FAILED) {
+			::munmap(sqRing_, sqRingSize_);
+			sqRing_ = MAP_FAILED;
+			::close(fd);
+			return;
+		}
+	}
+	sqesSize_ = p.sq_entries * sizeof(struct io_uring_sqe);
+	sqes_ = static_cast<struct io_uring_sqe*>(::mmap(NULL, sqesSize_, PROT_READ | PROT_WRITE,
+	                                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+	if (sqes_ == MAP_FAILED) {
+		if (cqRing_ != sqRing_) {
+			::munmap(cqRing_, cqRingSize_);
+		}
+		::munmap(sqRing_, sqRingSize_);
+		sqRing_ = cqRing_ = MAP_FAILED;
+		::close(fd);
+		return;
+	}
+
+	char* sq = static_cast<char*>(sqRing_);
+	sqHead_ = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+	sqTail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+	sqMask_ = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+	sqArray_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+	char* cq = static_cast<char*>(cqRing_);
+	cqHead_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+	cqTail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+	cqMask_ = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+	cqes_ = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+
+	sqEntries_ = p.sq_entries;
+	fd_ = fd;
+#else
+	(void)entries;
+#endif
+}
+
+IoUring::~IoUring()
+{
+	if (fd_ < 0) {
+		return;
+	}
+	::munmap(sqes_, sqesSize_);
+	if (cqRing_ != sqRing_) {
+		::munmap(cqRing_, cqRingSize_);
+	}
+	::munmap(sqRing_, sqRingSize_);
+	::close(fd_);
+}
+
+bool IoUring::supports(int opcode) const
+{
+#ifdef __NR_io_uring_register
+	const unsigned kMaxOps = 256;
+	size_t size = sizeof(struct io_uring_probe) + kMaxOps * sizeof(struct io_uring_probe_op);
+	std::unique_ptr<char[]> buf(new char[size]());
+	struct io_uring_probe* probe = reinterpret_cast<struct io_uring_probe*>(buf.get());
+	if (::syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE, probe, kMaxOps) < 0) {
+		return false;
+	}
+	return opcode >= 0 && opcode <= probe->last_op &&
+	       (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+#else
+	(void)opcode;
+	return false;
+#endif
+}
+
+struct io_uring_sqe* IoUring::getSqe()
+{
+	unsigned head = __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+	if (sqeTail_ - head >= sqEntries_) {
+		return NULL;
+	}
+	struct io_uring_sqe* sqe = &sqes_[sqeTail_ & *sqMask_];
+	++sqeTail_;
+	memset(sqe, 0, sizeof *sqe);
+	return sqe;
+}
+
+// 把getSqe()分配出去的SQE放入提交队列，返回个数
+unsigned IoUring::flushSq()
+{
+	unsigned tail = *sqTail_;
+	unsigned n = sqeTail_ - sqeHead_;
+	for (unsigned i = 0; i < n; ++i) {
+		sqArray_[tail & *sqMask_] = sqeHead_ & *sqMask_;
+		++tail;
+		++sqeHead_;
+	}
+	__atomic_store_n(sqTail_, tail, __ATOMIC_RELEASE);
+	return n;
+}
+
+int IoUring::submit(unsigned waitNr)
+{
+#ifdef __NR_io_uring_enter
+	unsigned n = flushSq();
+	unsigned flags = waitNr > 0 ? IORING_ENTER_GETEVENTS : 0;
+	for (;;) {
+		int ret = static_cast<int>(::syscall(__NR_io_uring_enter, fd_, n, waitNr, flags, NULL, 0));
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		return ret < 0 ? -errno : ret;
+	}
+#else
+	(void)waitNr;
+	return -ENOSYS;
+#endif
+}
+
+bool IoUring::peekCqe(struct io_uring_cqe* cqe)
+{
+	unsigned head = *cqHead_;
+	unsigned tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+	if (head == tail) {
+		return false;
+	}
+	*cqe = cqes_[head & *cqMask_];
+	__atomic_store_n(cqHead_, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
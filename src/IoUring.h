@@ -0,0 +1,71 @@
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+#ifndef IOURING_H
+#define IOURING_H
+
+#include "noncopyable.h"
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+// 直接用系统调用实现的最小io_uring封装，不依赖liburing
+// 只在一个线程中使用，不是线程安全的
+class IoUring : noncopyable
+{
+public:
+	explicit IoUring(unsigned entries);
+	~IoUring();
+
+	// 内核不支持或者没有权限时为false，此时不能调用其他函数
+	bool valid() const
+	{
+		return fd_ >= 0;
+	}
+
+	unsigned entries() const
+	{
+		return sqEntries_;
+	}
+
+	// 用IORING_REGISTER_PROBE查询内核是否支持opcode
+	// 5.1~5.5的内核可以建立io_uring，但没有PROBE，也没有IORING_OP_WRITE等，一律返回false
+	bool supports(int opcode) const;
+
+	// 取一个清零的SQE，提交队列已满时返回NULL
+	struct io_uring_sqe* getSqe();
+
+	// 提交所有填好的SQE，waitNr大于0时至少等到waitNr个完成事件
+	// 返回提交的个数，出错返回-errno
+	int submit(unsigned waitNr);
+
+	// 取出一个完成事件，没有时返回false
+	bool peekCqe(struct io_uring_cqe* cqe);
+
+private:
+	unsigned flushSq();
+
+	int fd_;
+	unsigned sqEntries_;
+
+	void* sqRing_;
+	size_t sqRingSize_;
+	void* cqRing_;
+	size_t cqRingSize_;
+	struct io_uring_sqe* sqes_;
+	size_t sqesSize_;
+
+	unsigned* sqHead_;
+	unsigned* sqTail_;
+	unsigned* sqMask_;
+	unsigned* sqArray_;
+	unsigned* cqHead_;
+	unsigned* cqTail_;
+	unsigned* cqMask_;
+	struct io_uring_cqe* cqes_;
+
+	unsigned sqeHead_;   // 已经放入提交队列的SQE
+	unsigned sqeTail_;   // 已经分配出去的SQE
+};
+
+#endif  // IOURING_H
@@ -0,0 +1,128 @@
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+#include "LatencyHistogram.h"
+
+#include "CurrentThread.h"
+
+#include <math.h>
+#include <stdio.h>
+
+namespace
+{
+
+const int kSubBuckets = 1 << LatencyHistogram::kSubBucketBits;
+
+}  // namespace
+
+LatencyHistogram::LatencyHistogram()
+	: shards_(new Shard[kShards])
+{
+	for (int i = 0; i < kShards; ++i) {
+		for (int b = 0; b < kBuckets; ++b) {
+			shards_[i].counts[b].store(0, std::memory_order_relaxed);
+		}
+		shards_[i].sum.store(0, std::memory_order_relaxed);
+	}
+}
+
+// 小于16的值每个值一个桶，之后最高位为msb的值按接下来的4位分成16个桶
+int LatencyHistogram::bucketIndex(int64_t value)
+{
+	if (value < kSubBuckets) {
+		return value < 0 ? 0 : static_cast<int>(value);
+	}
+	int msb = 63 - __builtin_clzll(static_cast<uint64_t>(value));
+	if (msb >= kMaxValueBits) {
+		return kBuckets - 1;
+	}
+	int sub = static_cast<int>(value >> (msb - kSubBucketBits)) & (kSubBuckets - 1);
+	return ((msb - kSubBucketBits + 1) << kSubBucketBits) + sub;
+}
+
+int64_t LatencyHistogram::bucketHighestValue(int index)
+{
+	if (index < kSubBuckets) {
+		return index;
+	}
+	int msb = (index >> kSubBucketBits) + kSubBucketBits - 1;
+	int sub = index & (kSubBuckets - 1);
+	int64_t width = static_cast<int64_t>(1) << (msb - kSubBucketBits);
+	return (kSubBuckets + sub) * width + width - 1;
+}
+
+void LatencyHistogram::record(int64_t nanoseconds)
+{
+	Shard& shard = shards_[CurrentThread::tid() & (kShards - 1)];
+	shard.counts[bucketIndex(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+	shard.sum.fetch_add(nanoseconds, std::memory_order_relaxed);
+}
+
+LatencyHistogram::Snapshot LatencyHistogram::snapshot() const
+{
+	Snapshot s;
+	s.counts_.assign(kBuckets, 0);
+	for (int i = 0; i < kShards; ++i) {
+		for (int b = 0; b < kBuckets; ++b) {
+			int64_t n = shards_[i].counts[b].load(std::memory_order_relaxed);
+			s.counts_[b] += n;
+			s.count_ += n;
+		}
+		s.sum_ += shards_[i].sum.load(std::memory_order_relaxed);
+	}
+	return s;
+}
+
+LatencyHistogram::Snapshot::Snapshot()
+	: count_(0),
+	  sum_(0)
+{
+}
+
+double LatencyHistogram::Snapshot::mean() const
+{
+	return count_ > 0 ? static_cast<double>(sum_) / static_cast<double>(count_) : 0;
+}
+
+int64_t LatencyHistogram::Snapshot::max() const
+{
+	for (int b = static_cast<int>(counts_.size()) - 1; b >= 0; --b) {
+		if (counts_[b] > 0) {
+			return bucketHighestValue(b);
+		}
+	}
+	return 0;
+}
+
+int64_t LatencyHistogram::Snapshot::percentile(double percent) const
+{
+	if (count_ == 0) {
+		return 0;
+	}
+	int64_t target = static_cast<int64_t>(ceil(percent / 100.0 * static_cast<double>(count_)));
+	if (target < 1) {
+		target = 1;
+	}
+	int64_t seen = 0;
+	for (size_t b = 0; b < counts_.size(); ++b) {
+		seen += counts_[b];
+		if (seen >= target) {
+			return bucketHighestValue(static_cast<int>(b));
+		}
+	}
+	return max();
+}
+
+string LatencyHistogram::Snapshot::toString() const
+{
+	char buf[256];
+	snprintf(buf, sizeof buf,
+	         "count=%lld mean=%.1fus p50=%.1fus p90=%.1fus p99=%.1fus p99.9=%.1fus max=%.1fus",
+	         static_cast<long long>(count_), mean() / 1000,
+	         static_cast<double>(percentile(50)) / 1000,
+	         static_cast<double>(percentile(90)) / 1000,
+	         static_cast<double>(percentile(99)) / 1000,
+	         static_cast<double>(percentile(99.9)) / 1000,
+	         static_cast<double>(max()) / 1000);
+	return buf;
+}
@@ -0,0 +1,79 @@
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+#ifndef LATENCYHISTOGRAM_H
+#define LATENCYHISTOGRAM_H
+
+#include "copyable.h"
+#include "noncopyable.h"
+#include "Types.h"
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include <time.h>
+
+// HDR风格的延迟直方图，单位纳秒
+// 每个2的幂区间再等分成16个桶，相对误差不超过1/16，超过2^40纳秒(约18分钟)的都算在最后一个桶
+// 记录时只做两次原子加，按线程id分散到kShards份计数，避免多个线程争用同一个cache line，读取时合并
+class LatencyHistogram : noncopyable
+{
+public:
+	static const int kSubBucketBits = 4;
+	static const int kMaxValueBits = 40;
+	static const int kBuckets = (kMaxValueBits - kSubBucketBits + 1) << kSubBucketBits;
+	static const int kShards = 8;
+
+	// 某一时刻的计数，可以拷贝
+	class Snapshot : public copyable
+	{
+	public:
+		Snapshot();
+
+		int64_t count() const
+		{
+			return count_;
+		}
+		double mean() const;
+		int64_t max() const;
+		// 至少percent%的值不超过返回值，percent取0~100
+		int64_t percentile(double percent) const;
+
+		// "count=... mean=...us p50=...us p90=... p99=... p99.9=... max=..."
+		string toString() const;
+
+	private:
+		friend class LatencyHistogram;
+
+		std::vector<int64_t> counts_;
+		int64_t count_;
+		int64_t sum_;
+	};
+
+	LatencyHistogram();
+
+	void record(int64_t nanoseconds);
+	Snapshot snapshot() const;
+
+	// 单调时钟，纳秒
+	static int64_t now()
+	{
+		struct timespec ts;
+		::clock_gettime(CLOCK_MONOTONIC, &ts);
+		return static_cast<int64_t>(ts.tv_sec) * 1000 * 1000 * 1000 + ts.tv_nsec;
+	}
+
+	static int bucketIndex(int64_t value);
+	static int64_t bucketHighestValue(int index);
+
+private:
+	struct Shard {
+		std::atomic<int64_t> counts[kBuckets];
+		std::atomic<int64_t> sum;
+	};
+
+	std::unique_ptr<Shard[]> shards_;
+};
+
+#endif  // LATENCYHISTOGRAM_H
@@ -0,0 +1,128 @@
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+#ifndef LOCKFREEQUEUE_H
+#define LOCKFREEQUEUE_H
+
+#include "noncopyable.h"
+
+#include <atomic>
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+
+// 有界无锁队列，参考Dmitry Vyukov的bounded MPMC queue
+// http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+// 每个槽位带一个序号，生产者和消费者各自只对一个位置计数做CAS，
+// 多生产者单消费者(MPSC)和多生产者多消费者都可以使用
+template<typename T>
+class LockFreeQueue : noncopyable
+{
+public:
+	// capacity会向上取整为2的幂
+	explicit LockFreeQueue(size_t capacity)
+		: capacity_(roundUp(capacity)),
+		  mask_(capacity_ - 1),
+		  cells_(new Cell[capacity_]),
+		  enqueuePos_(0),
+		  dequeuePos_(0)
+	{
+		for (size_t i = 0; i < capacity_; ++i) {
+			cells_[i].sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	// 队列满时返回false，此时x保持不变
+	bool tryPut(T&& x)
+	{
+		Cell* cell;
+		size_t pos = enqueuePos_.load(std::memory_order_relaxed);
+		for (;;) {
+			cell = &cells_[pos & mask_];
+			size_t seq = cell->sequence.load(std::memory_order_acquire);
+			intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+			if (diff == 0) {
+				if (enqueuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			} else if (diff < 0) {
+				return false;  // full
+			} else {
+				pos = enqueuePos_.load(std::memory_order_relaxed);
+			}
+		}
+		cell->data = std::move(x);
+		cell->sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	// 队列空时返回false
+	bool tryTake(T* x)
+	{
+		Cell* cell;
+		size_t pos = dequeuePos_.load(std::memory_order_relaxed);
+		for (;;) {
+			cell = &cells_[pos & mask_];
+			size_t seq = cell->sequence.load(std::memory_order_acquire);
+			intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+			if (diff == 0) {
+				if (dequeuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			} else if (diff < 0) {
+				return false;  // empty
+			} else {
+				pos = dequeuePos_.load(std::memory_order_relaxed);
+			}
+		}
+		*x = std::move(cell->data);
+		cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+		return true;
+	}
+
+	// 并发修改时只是一个近似值
+	size_t size() const
+	{
+		size_t enqueue = enqueuePos_.load(std::memory_order_acquire);
+		size_t dequeue = dequeuePos_.load(std::memory_order_acquire);
+		return enqueue > dequeue ? enqueue - dequeue : 0;
+	}
+
+	bool empty() const
+	{
+		return size() == 0;
+	}
+
+	size_t capacity() const
+	{
+		return capacity_;
+	}
+
+private:
+	struct Cell {
+		std::atomic<size_t> sequence;
+		T data;
+	};
+
+	static size_t roundUp(size_t n)
+	{
+		size_t capacity = 2;
+		while (capacity < n) {
+			capacity <<= 1;
+		}
+		return capacity;
+	}
+
+	static const size_t kCacheLine = 64;
+
+	const size_t capacity_;
+	const size_t mask_;
+	std::unique_ptr<Cell[]> cells_;
+	char pad0_[kCacheLine];  // 生产者和消费者的位置计数放在不同的cache line，避免伪共享
+	std::atomic<size_t> enqueuePos_;
+	char pad1_[kCacheLine];
+	std::atomic<size_t> dequeuePos_;
+	char pad2_[kCacheLine];
+};
+
+#endif  // LOCKFREEQUEUE_H
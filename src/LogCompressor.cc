@@ -0,0 +1,177 @@
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+#include "LogCompressor.h"
+
+#include "CurrentThread.h"
+#include "Logging.h"
+#include "Timestamp.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <zlib.h>
+
+LogCompressor::LogCompressor(int level, int64_t bytesPerSecond, int niceness)
+	: level_(level),
+	  bytesPerSecond_(bytesPerSecond),
+	  niceness_(niceness),
+	  running_(false),
+	  thread_(std::bind(&LogCompressor::threadFunc, this), "LogCompressor"),
+	  compressedFiles_(0),
+	  readBuffer_(new char[kReadBufferSize])
+{
+}
+
+LogCompressor::~LogCompressor()
+{
+	if (running_) {
+		stop();
+	}
+}
+
+void LogCompressor::start()
+{
+	running_ = true;
+	thread_.start();
+}
+
+void LogCompressor::stop()
+{
+	running_ = false;
+	queue_.put(string());
+	thread_.join();
+}
+
+void LogCompressor::compress(const string& filename)
+{
+	assert(!filename.empty());
+	queue_.put(filename);
+}
+
+void LogCompressor::threadFunc()
+{
+	// 只降低本线程的CPU和IO优先级，不影响写日志的线程
+	if (::setpriority(PRIO_PROCESS, CurrentThread::tid(), niceness_) < 0) {
+		fprintf(stderr, "LogCompressor: setpriority failed %s\n", strerror_tl(errno));
+	}
+#ifdef SYS_ioprio_set
+	const int kIoprioWhoProcess = 1;
+	const int kIoprioClassIdle = 3;
+	const int kIoprioClassShift = 13;
+	::syscall(SYS_ioprio_set, kIoprioWhoProcess, CurrentThread::tid(), kIoprioClassIdle << kIoprioClassShift);
+#endif
+
+	// 空字符串在所有已经排队的文件之后，stop()时这些文件也都压缩完
+	for (;;) {
+		string filename = queue_.take();
+		if (filename.empty()) {
+			break;
+		}
+		if (compressFile(filename)) {
+			compressedFiles_.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+}
+
+// 成功时原文件被filename.gz代替，失败时原文件保持不变
+bool LogCompressor::compressFile(const string& filename)
+{
+	const string gzName = filename + ".gz";
+	const string tmpName = gzName + ".tmp";
+
+	int in = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (in < 0) {
+		fprintf(stderr, "LogCompressor: open %s failed %s\n", filename.c_str(), strerror_tl(errno));
+		return false;
+	}
+	int out = ::open(tmpName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (out < 0) {
+		fprintf(stderr, "LogCompressor: open %s failed %s\n", tmpName.c_str(), strerror_tl(errno));
+		::close(in);
+		return false;
+	}
+	// gzclose()会关闭传进去的fd，留着out做fsync；gzdopen()失败时不会关闭，要自己关
+	char mode[8];
+	snprintf(mode, sizeof mode, "wb%d", level_);
+	gzFile gz = NULL;
+	int gzFd = ::dup(out);
+	if (gzFd < 0) {
+		fprintf(stderr, "LogCompressor: dup %s failed %s\n", tmpName.c_str(), strerror_tl(errno));
+	} else {
+		gz = ::gzdopen(gzFd, mode);
+		if (gz == NULL) {
+			::close(gzFd);
+		}
+	}
+
+	bool ok = gz != NULL;
+	char* buf = readBuffer_.get();
+	int64_t total = 0;
+	Timestamp begin = Timestamp::now();
+	while (ok) {
+		ssize_t n = ::read(in, buf, kReadBufferSize);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			ok = n == 0;
+			break;
+		}
+		if (::gzwrite(gz, buf, static_cast<unsigned>(n)) != n) {
+			ok = false;
+			break;
+		}
+
+		// 按读入的字节数限速，stop()之后尽快压缩完
+		total += n;
+		if (bytesPerSecond_ > 0 && running_) {
+			double expected = static_cast<double>(total) / static_cast<double>(bytesPerSecond_);
+			double elapsed = timeDifference(Timestamp::now(), begin);
+			if (expected > elapsed) {
+				CurrentThread::sleepUsec(static_cast<int64_t>((expected - elapsed) * Timestamp::kMicroSecondsPerSecond));
+			}
+		}
+	}
+
+	if (gz && ::gzclose(gz) != Z_OK) {
+		ok = false;
+	}
+	if (ok && ::fsync(out) < 0) {
+		ok = false;
+	}
+	::close(out);
+	::close(in);
+
+	if (ok && ::rename(tmpName.c_str(), gzName.c_str()) == 0) {
+		::unlink(filename.c_str());
+		syncDirectory(filename);
+		return true;
+	}
+	fprintf(stderr, "LogCompressor: compress %s failed\n", filename.c_str());
+	::unlink(tmpName.c_str());
+	return false;
+}
+
+// rename和unlink要fsync所在目录才能保证掉电后不会既没有.gz又没有原文件
+void LogCompressor::syncDirectory(const string& filename)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof path, "%s", filename.c_str());
+	int dir = ::open(::dirname(path), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir < 0) {
+		fprintf(stderr, "LogCompressor: open directory of %s failed %s\n", filename.c_str(), strerror_tl(errno));
+		return;
+	}
+	if (::fsync(dir) < 0) {
+		fprintf(stderr, "LogCompressor: fsync directory of %s failed %s\n", filename.c_str(), strerror_tl(errno));
+	}
+	::close(dir);
+}
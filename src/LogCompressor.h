@@ -0,0 +1,59 @@
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+#ifndef LOGCOMPRESSOR_H
+#define LOGCOMPRESSOR_H
+
+#include "BlockingQueue.h"
+#include "Thread.h"
+#include "Types.h"
+
+#include <atomic>
+#include <memory>
+
+// 后台压缩已经roll掉的日志文件，代替外部的logrotate+gzip
+// 单独一个低优先级线程(nice + 空闲IO调度类)，按bytesPerSecond限速读入原文件，
+// 压缩成gzip写到"文件名.gz.tmp"，fsync后rename成"文件名.gz"再删除原文件，最后fsync所在目录，
+// 任何时候都不会看到写了一半的.gz文件
+class LogCompressor : noncopyable
+{
+public:
+	static const int64_t kDefaultBytesPerSecond = 16 * 1024 * 1024;
+	static const int kReadBufferSize = 64 * 1024;
+
+	// level为zlib压缩级别1~9，bytesPerSecond为每秒最多读入的原文件字节数，0表示不限速
+	explicit LogCompressor(int level = 6,
+	                       int64_t bytesPerSecond = kDefaultBytesPerSecond,
+	                       int niceness = 19);
+	~LogCompressor();
+
+	void start();
+
+	// 正在压缩的和已经排队的文件全部压缩完才返回，剩下的部分不再限速
+	void stop();
+
+	// 把一个已经关闭、不再写入的文件交给后台压缩，可以在任意线程调用
+	void compress(const string& filename);
+
+	// 已经压缩完成的文件数
+	int64_t compressedFiles() const
+	{
+		return compressedFiles_.load(std::memory_order_relaxed);
+	}
+
+private:
+	void threadFunc();
+	bool compressFile(const string& filename);
+	static void syncDirectory(const string& filename);
+
+	const int level_;
+	const int64_t bytesPerSecond_;
+	const int niceness_;
+	std::atomic<bool> running_;     // stop()之后为false，不再限速
+	Thread thread_;
+	BlockingQueue<string> queue_;   // 空字符串表示退出
+	std::atomic<int64_t> compressedFiles_;
+	std::unique_ptr<char[]> readBuffer_;   // 只在压缩线程中使用，不占线程栈
+};
+
+#endif  // LOGCOMPRESSOR_H
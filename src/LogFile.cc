@@ -5,12 +5,16 @@
 
 #include "LogFile.h"
 
+#include "BinaryLog.h"
 #include "FileUtil.h"
+#include "FrameCompressor.h"
+#include "LogCompressor.h"
 #include "ProcessInfo.h"
 
 #include <assert.h>
 #include <stdio.h>
 #include <time.h>
+#include <sys/uio.h>
 
 
 // https://blog.csdn.net/wanggao_1990/article/details/118882674
@@ -19,22 +23,40 @@ LogFile::LogFile(const string& basename, //  日志文件名，默认保存在
                  off_t rollSize,           //  日志文件超过设定值进行roll
                  bool threadSafe,          //  默认线程安全，使用互斥锁操作将消息写入缓冲区
                  int flushInterval,        //  flush刷新时间间隔
-                 int checkEveryN)          //  每1024次日志操作，检查一个是否刷新、是否roll
+                 int checkEveryN,          //  每1024次日志操作，检查一个是否刷新、是否roll
+                 const FileUtil::AppendOptions& options, //  日志文件的写入方式
+                 bool binaryFormat)        //  把Logger deferred模式的记录编码成二进制格式写入
 	: basename_(basename),
 	  rollSize_(rollSize),
 	  flushInterval_(flushInterval),
 	  checkEveryN_(checkEveryN),
+	  options_(options),
 	  count_(0),
 	  mutex_(threadSafe ? new MutexLock : NULL), // 操作AppendFiles是否加锁
 	  startOfPeriod_(0),                         // 用于标记同一天的时间戳(GMT的零点)
 	  lastRoll_(0),                              // 上一次roll的时间戳
-	  lastFlush_(0)                              // 上一次flush的时间戳
+	  lastFlush_(0),                             // 上一次flush的时间戳
+	  droppedCacheBytes_(0),
+	  rolls_(0),
+	  compressor_(NULL),
+	  encoder_(binaryFormat ? new BinaryLogEncoder : NULL),
+	  rollOnRawBytes_(false),
+	  rawBytes_(0)
 {
 	assert(basename.find('/') == string::npos);
 	rollFile();
 }
 
-LogFile::~LogFile() = default;
+LogFile::~LogFile()
+{
+	closeFile();
+}
+
+void LogFile::setFrameCompression(int level, bool rollOnRawBytes)
+{
+	frameCompressor_.reset(new FrameCompressor(level));
+	rollOnRawBytes_ = rollOnRawBytes;
+}
 
 // 将len长度logline写入日志
 void LogFile::append(const char* logline, int len)
@@ -47,6 +69,16 @@ void LogFile::append(const char* logline, int len)
 	}
 }
 
+void LogFile::append(const struct iovec* iov, int iovcnt)
+{
+	if (mutex_) {
+		MutexLockGuard lock(*mutex_);
+		append_unlocked(iov, iovcnt);
+	} else {
+		append_unlocked(iov, iovcnt);
+	}
+}
+
 void LogFile::flush()
 {
 	if (mutex_) {
@@ -60,13 +92,60 @@ void LogFile::flush()
 // 将len长度logline添加到日志
 void LogFile::append_unlocked(const char* logline, int len)
 {
-	file_->append(logline, len);
+	const char* data = logline;
+	size_t size = len;
+	if (encoder_) {
+		encoded_.clear();
+		encoder_->encode(logline, len, &encoded_);
+		data = encoded_.data();
+		size = encoded_.size();
+	}
+	rawBytes_ += size;
+	if (frameCompressor_) {
+		compressed_.clear();
+		frameCompressor_->compress(data, size, &compressed_);
+		data = compressed_.data();
+		size = compressed_.size();
+	}
+	file_->append(data, size);
+	checkRollAndFlush(1);
+}
+
+// 按逐块append时的规则分组：写完使文件超过rollSize_的那一块就roll，其余块合并成一次writev
+void LogFile::append_unlocked(const struct iovec* iov, int iovcnt)
+{
+	// 二进制格式和压缩要先编码，逐块写入，写完就交还
+	if (encoder_ || frameCompressor_) {
+		for (int i = 0; i < iovcnt; ++i) {
+			append_unlocked(static_cast<const char*>(iov[i].iov_base), static_cast<int>(iov[i].iov_len));
+			if (options_.release) {
+				options_.release(iov[i].iov_base);
+			}
+		}
+		return;
+	}
+
+	int begin = 0;
+	off_t written = file_->writtenBytes();
+	for (int i = 0; i < iovcnt; ++i) {
+		written += iov[i].iov_len;
+		if (written > rollSize_ || i == iovcnt - 1) {
+			file_->append(iov + begin, i + 1 - begin);
+			checkRollAndFlush(i + 1 - begin);
+			begin = i + 1;
+			written = file_->writtenBytes();
+		}
+	}
+}
 
+// 刚写入了appended次日志，检查是否需要roll或者flush
+void LogFile::checkRollAndFlush(int appended)
+{
 	// 当前写入日志总长度超过 rollSize_， 就进行日志roll
-	if (file_->writtenBytes() > rollSize_) {
+	if (rollBytes() > rollSize_) {
 		rollFile();
 	} else {
-		++count_;
+		count_ += appended;
 		// 每写入日志checkEveryN_ = 1024 次就检查是否需要roll
 		if (count_ >= checkEveryN_) {
 			count_ = 0;
@@ -98,12 +177,59 @@ bool LogFile::rollFile()
 		lastRoll_ = now;
 		lastFlush_ = now;
 		startOfPeriod_ = start;
-		file_.reset(new FileUtil::AppendFile(filename));
+		closeFile();
+		file_.reset(new FileUtil::AppendFile(filename, options_));
+		if (!filename_.empty()) {
+			++rolls_;
+			// 旧文件已经关闭，可以压缩了
+			if (compressor_) {
+				compressor_->compress(filename_);
+			}
+		}
+		filename_.swap(filename);
+		rawBytes_ = 0;
+		if (encoder_) {
+			encoder_->reset();
+		}
 		return true;
 	}
 	return false;
 }
 
+// 判断roll时使用的当前文件长度
+off_t LogFile::rollBytes() const
+{
+	return rollOnRawBytes_ ? rawBytes_ : file_->writtenBytes();
+}
+
+off_t LogFile::droppedCacheBytes() const
+{
+	if (mutex_) {
+		MutexLockGuard lock(*mutex_);
+		return droppedCacheBytes_ + file_->droppedCacheBytes();
+	}
+	return droppedCacheBytes_ + file_->droppedCacheBytes();
+}
+
+int64_t LogFile::rolls() const
+{
+	if (mutex_) {
+		MutexLockGuard lock(*mutex_);
+		return rolls_;
+	}
+	return rolls_;
+}
+
+// 不再写入的文件，把page cache中剩下的部分也丢掉
+void LogFile::closeFile()
+{
+	if (file_ && options_.dropCacheWindow > 0) {
+		file_->flush();
+		file_->dropCache(0);
+		droppedCacheBytes_ += file_->droppedCacheBytes();
+	}
+}
+
 // 构造一个日志文件名,日志名由基本名字+时间戳+主机名+进程id+加上“.log”后缀
 // now记录当前时间
 // 返回新生成的日志名
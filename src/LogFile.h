@@ -6,6 +6,7 @@
 #ifndef LOGFILE_H
 #define LOGFILE_H
 
+#include "FileUtil.h"
 #include "Mutex.h"
 #include "Types.h"
 
@@ -13,10 +14,10 @@
 
 
 
-namespace FileUtil
-{
-class AppendFile;
-}
+struct iovec;
+class BinaryLogEncoder;
+class FrameCompressor;
+class LogCompressor;
 
 class LogFile : noncopyable
 {
@@ -25,15 +26,39 @@ public:
 	        off_t rollSize,
 	        bool threadSafe = true,
 	        int flushInterval = 3,
-	        int checkEveryN = 1024);
+	        int checkEveryN = 1024,
+	        const FileUtil::AppendOptions& options = FileUtil::AppendOptions(),
+	        bool binaryFormat = false);
 	~LogFile();
 
 	void append(const char* logline, int len);
+	// 把多块数据用一次writev写入，roll的判断和逐块append时一致
+	void append(const struct iovec* iov, int iovcnt);
 	void flush();
 	bool rollFile();
 
+	// options.dropCacheWindow大于0时，所有文件累计从page cache中丢掉的字节数
+	off_t droppedCacheBytes() const;
+
+	// 构造之后roll的次数，不包括第一个文件
+	int64_t rolls() const;
+
+	// 每次append的数据压缩成一个独立的帧再写入，见FrameCompressor
+	// rollOnRawBytes为true时按压缩前的字节数判断是否roll，否则按实际写入文件的字节数
+	void setFrameCompression(int level, bool rollOnRawBytes);
+
+	// roll之后把关闭的文件交给compressor后台压缩，compressor由调用者管理，不能早于LogFile析构
+	void setCompressor(LogCompressor* compressor)
+	{
+		compressor_ = compressor;
+	}
+
 private:
 	void append_unlocked(const char* logline, int len);
+	void append_unlocked(const struct iovec* iov, int iovcnt);
+	void checkRollAndFlush(int appended);
+	off_t rollBytes() const;
+	void closeFile();
 
 	static string getLogFileName(const string& basename, time_t* now);
 
@@ -41,6 +66,7 @@ private:
 	const off_t rollSize_;
 	const int flushInterval_;
 	const int checkEveryN_;
+	const FileUtil::AppendOptions options_;  // roll出的每个文件都使用
 
 	int count_;
 
@@ -48,7 +74,17 @@ private:
 	time_t startOfPeriod_;
 	time_t lastRoll_;
 	time_t lastFlush_;
+	off_t droppedCacheBytes_;  // 已经关闭的文件丢掉的page cache字节数
+	int64_t rolls_;
 	std::unique_ptr<FileUtil::AppendFile> file_;
+	string filename_;                  // file_的文件名
+	LogCompressor* compressor_;
+	std::unique_ptr<BinaryLogEncoder> encoder_;  // 二进制格式，每个文件开头写文件头
+	string encoded_;
+	std::unique_ptr<FrameCompressor> frameCompressor_;
+	bool rollOnRawBytes_;
+	off_t rawBytes_;                   // 当前文件压缩前的字节数
+	string compressed_;
 
 	const static int kRollPerSeconds_ = 60*60*24;
 };
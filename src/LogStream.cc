@@ -7,11 +7,14 @@
 
 #include <algorithm>
 #include <limits>
+#include <new>
 #include <type_traits>
 #include <assert.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
 
 #ifndef __STDC_FORMAT_MACROS
 #define __STDC_FORMAT_MACROS
@@ -87,6 +90,104 @@ size_t convertHex(char buf[], uintptr_t value)
 template class FixedBuffer<kSmallBuffer>;
 template class FixedBuffer<kLargeBuffer>;
 
+namespace
+{
+
+size_t roundUp(size_t n, size_t alignment)
+{
+	return (n + alignment - 1) & ~(alignment - 1);
+}
+
+void* mapAnonymous(size_t len, int flags)
+{
+	return ::mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+}
+
+// 多映射一个大页再裁掉首尾，得到按大页对齐的len字节
+void* mapHugeAligned(size_t len, size_t hugePage)
+{
+	size_t total = len + hugePage;
+	char* raw = static_cast<char*>(mapAnonymous(total, 0));
+	if (raw == MAP_FAILED) {
+		return MAP_FAILED;
+	}
+	char* aligned = reinterpret_cast<char*>(roundUp(reinterpret_cast<uintptr_t>(raw), hugePage));
+	if (aligned > raw) {
+		::munmap(raw, aligned - raw);
+	}
+	char* end = raw + total;
+	if (end > aligned + len) {
+		::munmap(aligned + len, end - (aligned + len));
+	}
+	return aligned;
+}
+
+}  // namespace
+
+AlignedBuffer::AlignedBuffer(size_t capacity, const BufferAllocation& alloc)
+	: capacity_(capacity),
+	  mapped_(0),
+	  data_(NULL),
+	  cur_(NULL),
+	  touched_(0),
+	  hugePageAdvised_(false),
+	  locked_(false),
+	  pinned_(false)
+{
+	void* p = MAP_FAILED;
+	if (alloc.hugePages == BufferAllocation::kHugeTlb) {
+		mapped_ = roundUp(capacity, kHugePageSize);
+		p = mapAnonymous(mapped_, MAP_HUGETLB);
+		hugePageAdvised_ = pinned_ = p != MAP_FAILED;
+	} else if (alloc.hugePages == BufferAllocation::kTransparentHugePages) {
+		mapped_ = roundUp(capacity, kHugePageSize);
+		p = mapHugeAligned(mapped_, kHugePageSize);
+		hugePageAdvised_ = p != MAP_FAILED && ::madvise(p, mapped_, MADV_HUGEPAGE) == 0;
+	}
+	if (p == MAP_FAILED) {
+		mapped_ = roundUp(capacity, kAlignment);
+		p = mapAnonymous(mapped_, 0);
+		if (p == MAP_FAILED) {
+			throw std::bad_alloc();
+		}
+	}
+	data_ = static_cast<char*>(p);
+	cur_ = data_;
+
+	if (alloc.prefault) {
+		// 每页写一个字节，内容本来就无所谓
+		volatile char* page = data_;
+		for (size_t off = 0; off < mapped_; off += kAlignment) {
+			page[off] = 0;
+		}
+		pinned_ = true;
+	}
+	if (alloc.lock && ::mlock(data_, mapped_) == 0) {
+		locked_ = pinned_ = true;
+	}
+}
+
+AlignedBuffer::~AlignedBuffer()
+{
+	::munmap(data_, mapped_);
+}
+
+void AlignedBuffer::release(bool lazy)
+{
+	assert(length() == 0);
+	size_t len = roundUp(static_cast<size_t>(touched_), kAlignment);
+	if (len == 0 || pinned_) {
+		return;
+	}
+#ifdef MADV_FREE
+	if (!lazy || ::madvise(data_, len, MADV_FREE) != 0)
+#endif
+	{
+		::madvise(data_, len, MADV_DONTNEED);
+	}
+	touched_ = 0;
+}
+
 }  // namespace detail
 
 /*
@@ -235,10 +336,28 @@ void LogStream::staticCheck()
 	              "kMaxNumericSize is large enough");
 }
 
+// 超长的一行：把已经写入的内容搬到堆上至少两倍大的存储，之后的内容都写在那里
+// 原来的存储(比如输出端预留的空间)不再使用，由调用者用spilled()判断
+void LogStream::grow(int len)
+{
+	int64_t used = buffer_.length();
+	int64_t need = used + len + 1;
+	if (need > detail::kMaxLineSize) {
+		return;
+	}
+	int64_t size = std::max(2 * static_cast<int64_t>(buffer_.capacity()), need);
+	size = std::min(size, static_cast<int64_t>(detail::kMaxLineSize));
+	std::unique_ptr<char[]> bigger(new char[size]);
+	memcpy(bigger.get(), buffer_.data(), used);
+	buffer_.assign(bigger.get(), static_cast<int>(size), static_cast<int>(used));
+	storage_.swap(bigger);
+}
+
 // 格式化整数到缓冲区
 template<typename T>
 void LogStream::formatInteger(T v)
 {
+	ensure(kMaxNumericSize);
 	if (buffer_.avail() >= kMaxNumericSize) {
 		size_t len = convert(buffer_.current(), v);
 		buffer_.add(len);
@@ -260,43 +379,72 @@ LogStream& LogStream::operator<<(unsigned short v)
 
 LogStream& LogStream::operator<<(int v)
 {
+	if (deferred_) {
+		appendArg(kArgInt, v);
+		return *this;
+	}
 	formatInteger(v);
 	return *this;
 }
 
 LogStream& LogStream::operator<<(unsigned int v)
 {
+	if (deferred_) {
+		appendArg(kArgUInt, v);
+		return *this;
+	}
 	formatInteger(v);
 	return *this;
 }
 
 LogStream& LogStream::operator<<(long v)
 {
+	if (deferred_) {
+		appendArg(kArgLong, v);
+		return *this;
+	}
 	formatInteger(v);
 	return *this;
 }
 
 LogStream& LogStream::operator<<(unsigned long v)
 {
+	if (deferred_) {
+		appendArg(kArgULong, v);
+		return *this;
+	}
 	formatInteger(v);
 	return *this;
 }
 
 LogStream& LogStream::operator<<(long long v)
 {
+	if (deferred_) {
+		appendArg(kArgLongLong, v);
+		return *this;
+	}
 	formatInteger(v);
 	return *this;
 }
 
 LogStream& LogStream::operator<<(unsigned long long v)
 {
+	if (deferred_) {
+		appendArg(kArgULongLong, v);
+		return *this;
+	}
 	formatInteger(v);
 	return *this;
 }
 
 LogStream& LogStream::operator<<(const void* p)
 {
+	if (deferred_) {
+		appendArg(kArgPointer, p);
+		return *this;
+	}
 	uintptr_t v = reinterpret_cast<uintptr_t>(p);
+	ensure(kMaxNumericSize);
 	if (buffer_.avail() >= kMaxNumericSize) {
 		char* buf = buffer_.current();
 		buf[0] = '0';
@@ -310,6 +458,11 @@ LogStream& LogStream::operator<<(const void* p)
 // FIXME: replace this with Grisu3 by Florian Loitsch.
 LogStream& LogStream::operator<<(double v)
 {
+	if (deferred_) {
+		appendArg(kArgDouble, v);
+		return *this;
+	}
+	ensure(kMaxNumericSize);
 	if (buffer_.avail() >= kMaxNumericSize) {
 		int len = snprintf(buffer_.current(), kMaxNumericSize, "%.12g", v);
 		buffer_.add(len);
@@ -317,6 +470,370 @@ LogStream& LogStream::operator<<(double v)
 	return *this;
 }
 
+namespace
+{
+
+// 从deferred记录中读出一个参数的原始值
+template<typename V>
+bool readArg(const char** p, const char* end, V* v)
+{
+	if (end - *p < static_cast<ptrdiff_t>(sizeof *v)) {
+		return false;
+	}
+	memcpy(v, *p, sizeof *v);
+	*p += sizeof *v;
+	return true;
+}
+
+template<typename V>
+bool formatArg(LogStream& stream, const char** p, const char* end)
+{
+	V v;
+	if (!readArg(p, end, &v)) {
+		return false;
+	}
+	stream << v;
+	return true;
+}
+
+}  // namespace
+
+// 按类型标记逐个还原参数，和普通模式下调用同一个operator<<，所以输出的文本完全一致
+const char* LogStream::formatDeferred(const char* args, const char* end)
+{
+	assert(!deferred_);
+	const char* p = args;
+	while (p < end) {
+		bool ok = true;
+		switch (*p++) {
+		case kArgEnd:
+			return p;
+		case kArgInt:
+			ok = formatArg<int>(*this, &p, end);
+			break;
+		case kArgUInt:
+			ok = formatArg<unsigned int>(*this, &p, end);
+			break;
+		case kArgLong:
+			ok = formatArg<long>(*this, &p, end);
+			break;
+		case kArgULong:
+			ok = formatArg<unsigned long>(*this, &p, end);
+			break;
+		case kArgLongLong:
+			ok = formatArg<long long>(*this, &p, end);
+			break;
+		case kArgULongLong:
+			ok = formatArg<unsigned long long>(*this, &p, end);
+			break;
+		case kArgPointer:
+			ok = formatArg<const void*>(*this, &p, end);
+			break;
+		case kArgDouble:
+			ok = formatArg<double>(*this, &p, end);
+			break;
+		case kArgChar:
+			ok = formatArg<char>(*this, &p, end);
+			break;
+		case kArgString: {
+			uint16_t n = 0;
+			ok = readArg(&p, end, &n) && end - p >= n;
+			if (ok) {
+				append(p, n);
+				p += n;
+			}
+			break;
+		}
+		default:
+			ok = false;
+			break;
+		}
+		if (!ok) {
+			return NULL;
+		}
+	}
+	return NULL;
+}
+
+const char* LogStream::skipDeferred(const char* args, const char* end)
+{
+	const char* p = args;
+	while (p < end) {
+		size_t size = 0;
+		switch (*p++) {
+		case kArgEnd:
+			return p;
+		case kArgInt:
+			size = sizeof(int);
+			break;
+		case kArgUInt:
+			size = sizeof(unsigned int);
+			break;
+		case kArgLong:
+			size = sizeof(long);
+			break;
+		case kArgULong:
+			size = sizeof(unsigned long);
+			break;
+		case kArgLongLong:
+			size = sizeof(long long);
+			break;
+		case kArgULongLong:
+			size = sizeof(unsigned long long);
+			break;
+		case kArgPointer:
+			size = sizeof(const void*);
+			break;
+		case kArgDouble:
+			size = sizeof(double);
+			break;
+		case kArgChar:
+			size = sizeof(char);
+			break;
+		case kArgString: {
+			uint16_t n = 0;
+			if (!readArg(&p, end, &n)) {
+				return NULL;
+			}
+			size = n;
+			break;
+		}
+		default:
+			return NULL;
+		}
+		if (end - p < static_cast<ptrdiff_t>(size)) {
+			return NULL;
+		}
+		p += size;
+	}
+	return NULL;
+}
+
+namespace
+{
+
+void putVarint(string* out, uint64_t v)
+{
+	char buf[10];
+	int n = 0;
+	while (v >= 0x80) {
+		buf[n++] = static_cast<char>(v | 0x80);
+		v >>= 7;
+	}
+	buf[n++] = static_cast<char>(v);
+	out->append(buf, n);
+}
+
+bool getVarint(const char** p, const char* end, uint64_t* v)
+{
+	uint64_t result = 0;
+	for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+		uint8_t byte = static_cast<uint8_t>(*(*p)++);
+		result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			*v = result;
+			return true;
+		}
+	}
+	return false;
+}
+
+inline uint64_t zigzag(int64_t v)
+{
+	return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+}
+
+inline int64_t unzigzag(uint64_t v)
+{
+	return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+}
+
+template<typename V>
+bool exportSigned(const char** p, const char* end, string* out)
+{
+	V v;
+	if (!readArg(p, end, &v)) {
+		return false;
+	}
+	putVarint(out, zigzag(static_cast<int64_t>(v)));
+	return true;
+}
+
+template<typename V>
+bool exportUnsigned(const char** p, const char* end, string* out)
+{
+	V v;
+	if (!readArg(p, end, &v)) {
+		return false;
+	}
+	putVarint(out, static_cast<uint64_t>(v));
+	return true;
+}
+
+template<typename V>
+void putArg(string* out, char type, V v)
+{
+	out->push_back(type);
+	out->append(reinterpret_cast<const char*>(&v), sizeof v);
+}
+
+}  // namespace
+
+bool LogStream::exportDeferred(const char* args, const char* end, string* out)
+{
+	const char* p = args;
+	while (p < end) {
+		char type = *p++;
+		out->push_back(type);
+		bool ok = true;
+		switch (type) {
+		case kArgEnd:
+			return p == end;
+		case kArgInt:
+			ok = exportSigned<int>(&p, end, out);
+			break;
+		case kArgUInt:
+			ok = exportUnsigned<unsigned int>(&p, end, out);
+			break;
+		case kArgLong:
+			ok = exportSigned<long>(&p, end, out);
+			break;
+		case kArgULong:
+			ok = exportUnsigned<unsigned long>(&p, end, out);
+			break;
+		case kArgLongLong:
+			ok = exportSigned<long long>(&p, end, out);
+			break;
+		case kArgULongLong:
+			ok = exportUnsigned<unsigned long long>(&p, end, out);
+			break;
+		case kArgPointer: {
+			const void* v = NULL;
+			ok = readArg(&p, end, &v);
+			putVarint(out, reinterpret_cast<uintptr_t>(v));
+			break;
+		}
+		case kArgDouble: {
+			double v = 0;
+			uint64_t bits = 0;
+			ok = readArg(&p, end, &v);
+			static_assert(sizeof v == sizeof bits, "double must be 64 bits");
+			memcpy(&bits, &v, sizeof bits);
+			for (int i = 0; i < 8; ++i) {
+				out->push_back(static_cast<char>(bits >> (8 * i)));
+			}
+			break;
+		}
+		case kArgChar:
+			ok = p < end;
+			if (ok) {
+				out->push_back(*p++);
+			}
+			break;
+		case kArgString: {
+			uint16_t n = 0;
+			ok = readArg(&p, end, &n) && end - p >= n;
+			if (ok) {
+				putVarint(out, n);
+				out->append(p, n);
+				p += n;
+			}
+			break;
+		}
+		default:
+			ok = false;
+			break;
+		}
+		if (!ok) {
+			return false;
+		}
+	}
+	return false;
+}
+
+bool LogStream::importDeferred(const char* args, const char* end, string* out)
+{
+	const char* p = args;
+	while (p < end) {
+		char type = *p++;
+		uint64_t v = 0;
+		bool ok = true;
+		switch (type) {
+		case kArgEnd:
+			out->push_back(kArgEnd);
+			return p == end;
+		case kArgInt:
+			ok = getVarint(&p, end, &v);
+			putArg(out, kArgInt, static_cast<int>(unzigzag(v)));
+			break;
+		case kArgUInt:
+			ok = getVarint(&p, end, &v);
+			putArg(out, kArgUInt, static_cast<unsigned int>(v));
+			break;
+		case kArgLong:
+		case kArgLongLong: {
+			ok = getVarint(&p, end, &v);
+			long long n = unzigzag(v);
+			if (type == kArgLong && n == static_cast<long>(n)) {
+				putArg(out, kArgLong, static_cast<long>(n));
+			} else {
+				putArg(out, kArgLongLong, n);
+			}
+			break;
+		}
+		case kArgULong:
+		case kArgULongLong: {
+			ok = getVarint(&p, end, &v);
+			unsigned long long n = v;
+			if (type == kArgULong && n == static_cast<unsigned long>(n)) {
+				putArg(out, kArgULong, static_cast<unsigned long>(n));
+			} else {
+				putArg(out, kArgULongLong, n);
+			}
+			break;
+		}
+		case kArgPointer:
+			ok = getVarint(&p, end, &v);
+			putArg(out, kArgPointer, reinterpret_cast<const void*>(static_cast<uintptr_t>(v)));
+			break;
+		case kArgDouble: {
+			ok = end - p >= 8;
+			if (ok) {
+				uint64_t bits = 0;
+				for (int i = 0; i < 8; ++i) {
+					bits |= static_cast<uint64_t>(static_cast<uint8_t>(*p++)) << (8 * i);
+				}
+				double d;
+				memcpy(&d, &bits, sizeof d);
+				putArg(out, kArgDouble, d);
+			}
+			break;
+		}
+		case kArgChar:
+			ok = p < end;
+			if (ok) {
+				putArg(out, kArgChar, *p++);
+			}
+			break;
+		case kArgString:
+			ok = getVarint(&p, end, &v) && v <= 0xFFFF && static_cast<uint64_t>(end - p) >= v;
+			if (ok) {
+				putArg(out, kArgString, static_cast<uint16_t>(v));
+				out->append(p, static_cast<size_t>(v));
+				p += v;
+			}
+			break;
+		default:
+			ok = false;
+			break;
+		}
+		if (!ok) {
+			return false;
+		}
+	}
+	return false;
+}
+
 // 按照fmt格式将val 格式化成字符串放入buf_中
 template<typename T>
 Fmt::Fmt(const char* fmt, T val)
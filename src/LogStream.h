@@ -9,6 +9,8 @@
 #include "noncopyable.h"
 #include "StringPiece.h"
 #include "Types.h"
+#include <memory>
+
 #include <assert.h>
 #include <string.h> // memcpy
 
@@ -19,6 +21,7 @@ namespace detail
 
 const int kSmallBuffer = 4000;
 const int kLargeBuffer = 4000*1000;
+const int kMaxLineSize = 16*1024*1024;   // LogStream写不下kSmallBuffer时最多扩大到的字节数
 
 template<int SIZE>
 class FixedBuffer : noncopyable
@@ -106,16 +109,227 @@ private:
 	char* cur_;         // 指向data_最后一位写入数据下一个字节的指针
 };
 
+// AlignedBuffer的分配方式，默认和普通的匿名mmap一样
+struct BufferAllocation
+{
+	enum HugePages {
+		kNoHugePages,
+		kTransparentHugePages,   // 按2MB对齐后MADV_HUGEPAGE，由内核决定是否真的用大页
+		kHugeTlb,                // MAP_HUGETLB，需要预留/proc/sys/vm/nr_hugepages，不够时退回普通页
+	};
+
+	BufferAllocation()
+		: hugePages(kNoHugePages),
+		  lock(false),
+		  prefault(false)
+	{ }
+
+	HugePages hugePages;
+	bool lock;       // mlock，受RLIMIT_MEMLOCK限制，失败时照常使用
+	bool prefault;   // 分配时就把每一页写一遍，缺页发生在分配时而不是第一次写日志时
+};
+
+// 运行时指定大小的大缓冲区，供AsyncLogging使用
+// 存储空间用匿名mmap分配，按页对齐，第一次写到时才由内核分配物理页并清零，不需要bzero()
+// 接口和FixedBuffer一致
+class AlignedBuffer : noncopyable
+{
+public:
+	typedef BufferAllocation Allocation;
+
+	static const size_t kAlignment = 4096;
+	static const size_t kHugePageSize = 2 * 1024 * 1024;
+
+	explicit AlignedBuffer(size_t capacity, const BufferAllocation& alloc = BufferAllocation());
+	~AlignedBuffer();
+
+	// 按要求申请了大页：MAP_HUGETLB成功时一定是大页；MADV_HUGEPAGE被接受只是建议，
+	// 内核是否真的用大页要看/proc/self/smaps中的AnonHugePages
+	bool hugePageAdvised() const
+	{
+		return hugePageAdvised_;
+	}
+	// mlock成功
+	bool locked() const
+	{
+		return locked_;
+	}
+
+	// 空buffer写过的页交还给内核，只在没有其他线程访问时调用
+	// 预先分配好的buffer(mlock、prefault或者MAP_HUGETLB)不交还
+	// lazy为true时用MADV_FREE：内存紧张时才回收，没被回收的页再写入时原样使用，但在回收前仍计入RSS；
+	// 否则(或者内核不支持MADV_FREE)用MADV_DONTNEED马上回收，再写入时重新缺页
+	void release(bool lazy = true);
+
+	void append(const char* /*restrict*/ buf, size_t len)
+	{
+		if (implicit_cast<size_t>(avail()) > len) {
+			memcpy(cur_, buf, len);
+			cur_ += len;
+		}
+	}
+
+	const char* data() const
+	{
+		return data_;
+	}
+	int length() const
+	{
+		return static_cast<int>(cur_ - data_);
+	}
+	size_t capacity() const
+	{
+		return capacity_;
+	}
+
+	// write to data_ directly
+	char* current()
+	{
+		return cur_;
+	}
+	int avail() const
+	{
+		return static_cast<int>(data_ + capacity_ - cur_);
+	}
+	void add(size_t len)
+	{
+		cur_ += len;
+	}
+
+	void reset()
+	{
+		if (cur_ - data_ > touched_) {
+			touched_ = cur_ - data_;
+		}
+		cur_ = data_;
+	}
+	void bzero()
+	{
+		memZero(data_, capacity_);
+	}
+
+	string toString() const
+	{
+		return string(data_, length());
+	}
+	StringPiece toStringPiece() const
+	{
+		return StringPiece(data_, length());
+	}
+
+private:
+	const size_t capacity_;
+	size_t mapped_;           // capacity_按页(或大页)取整
+	char* data_;
+	char* cur_;
+	ptrdiff_t touched_;       // release()之后写到过的最远位置
+	bool hugePageAdvised_;
+	bool locked_;
+	bool pinned_;             // 物理页已经分配好，release()不交还
+};
+
+// 指向调用者提供的一段内存，接口和FixedBuffer一致，自己不分配存储
+// LogStream在其中格式化，这段内存可以直接是输出端缓冲区中预留的空间
+class SpanBuffer : noncopyable
+{
+public:
+	SpanBuffer(char* data, int size)
+		: data_(data),
+		  cur_(data),
+		  end_(data + size)
+	{ }
+
+	// 换到size字节的data，其中前length字节是已经写入的内容
+	void assign(char* data, int size, int length)
+	{
+		data_ = data;
+		cur_ = data + length;
+		end_ = data + size;
+	}
+
+	void append(const char* /*restrict*/ buf, size_t len)
+	{
+		if (implicit_cast<size_t>(avail()) > len) {
+			memcpy(cur_, buf, len);
+			cur_ += len;
+		}
+	}
+
+	const char* data() const
+	{
+		return data_;
+	}
+	int length() const
+	{
+		return static_cast<int>(cur_ - data_);
+	}
+
+	// write to data_ directly
+	char* current()
+	{
+		return cur_;
+	}
+	int avail() const
+	{
+		return static_cast<int>(end_ - cur_);
+	}
+	int capacity() const
+	{
+		return static_cast<int>(end_ - data_);
+	}
+	void add(size_t len)
+	{
+		cur_ += len;
+	}
+
+	void reset()
+	{
+		cur_ = data_;
+	}
+
+	string toString() const
+	{
+		return string(data_, length());
+	}
+	StringPiece toStringPiece() const
+	{
+		return StringPiece(data_, length());
+	}
+
+private:
+	char* data_;
+	char* cur_;
+	char* end_;
+};
+
 }  // namespace detail
 
 class LogStream : noncopyable
 {
 	typedef LogStream self;
 public:
-	typedef detail::FixedBuffer<detail::kSmallBuffer> Buffer;
+	typedef detail::SpanBuffer Buffer;
+
+	// 自带kSmallBuffer字节的存储
+	LogStream()
+		: storage_(new char[detail::kSmallBuffer]),
+		  buffer_(storage_.get(), detail::kSmallBuffer),
+		  deferred_(false)
+	{ }
+
+	// 直接在data开始的size字节中格式化，data由调用者保证在使用期间有效
+	LogStream(char* data, int size)
+		: buffer_(data, size),
+		  deferred_(false)
+	{ }
 
 	self& operator<<(bool v)
 	{
+		if (deferred_) {
+			appendArg(kArgChar, v ? '1' : '0');
+			return *this;
+		}
+		ensure(1);
 		buffer_.append(v ? "1" : "0", 1);
 		return *this;
 	}
@@ -141,6 +355,11 @@ public:
 
 	self& operator<<(char v)
 	{
+		if (deferred_) {
+			appendArg(kArgChar, v);
+			return *this;
+		}
+		ensure(1);
 		buffer_.append(&v, 1);
 		return *this;
 	}
@@ -151,9 +370,9 @@ public:
 	self& operator<<(const char* str)
 	{
 		if (str) {
-			buffer_.append(str, strlen(str));
+			append(str, static_cast<int>(strlen(str)));
 		} else {
-			buffer_.append("(null)", 6);
+			append("(null)", 6);
 		}
 		return *this;
 	}
@@ -165,13 +384,13 @@ public:
 
 	self& operator<<(const string& v)
 	{
-		buffer_.append(v.c_str(), v.size());
+		append(v.c_str(), static_cast<int>(v.size()));
 		return *this;
 	}
 
 	self& operator<<(const StringPiece& v)
 	{
-		buffer_.append(v.data(), v.size());
+		append(v.data(), v.size());
 		return *this;
 	}
 
@@ -183,6 +402,11 @@ public:
 
 	void append(const char* data, int len)
 	{
+		if (deferred_) {
+			appendStringArg(data, len);
+			return;
+		}
+		ensure(len);
 		buffer_.append(data, len);
 	}
 	const Buffer& buffer() const
@@ -194,7 +418,103 @@ public:
 		buffer_.reset();
 	}
 
+	// 写不下时已经换到了堆上更大的存储，不再是构造时给的那段内存
+	bool spilled(const char* data) const
+	{
+		return buffer_.data() != data;
+	}
+
+	// 延迟格式化模式：operator<<不再转换成文本，只记下参数的类型和原始值，
+	// 由后台线程用formatDeferred()还原成和普通模式相同的文本
+	void setDeferred(bool on)
+	{
+		deferred_ = on;
+	}
+	bool deferred() const
+	{
+		return deferred_;
+	}
+
+	// 结束deferred模式下的一组参数，结束标记总能写入
+	void endDeferred()
+	{
+		assert(deferred_ && buffer_.avail() > 0);
+		*buffer_.current() = kArgEnd;
+		buffer_.add(1);
+	}
+
+	// 把endDeferred()结束的一组参数格式化成文本追加到本对象，
+	// 返回结束标记之后的位置，数据不完整时返回NULL
+	const char* formatDeferred(const char* args, const char* end);
+
+	// 跳过一组deferred参数，返回结束标记之后的位置，数据不完整时返回NULL
+	static const char* skipDeferred(const char* args, const char* end);
+
+	// 把一组deferred参数(包括结束标记)转换成和机器无关的格式追加到out，数据不完整时返回false
+	// 整数zigzag/varint，指针varint，double按小端8字节，字符串长度varint，类型标记不变
+	static bool exportDeferred(const char* args, const char* end, string* out);
+
+	// exportDeferred()的逆过程，out中是本机的deferred参数，本机long放不下的值换成long long
+	static bool importDeferred(const char* args, const char* end, string* out);
+
 private:
+	// deferred模式下参数的类型标记，后面跟着原始值
+	enum ArgType {
+		kArgEnd,
+		kArgInt,
+		kArgUInt,
+		kArgLong,
+		kArgULong,
+		kArgLongLong,
+		kArgULongLong,
+		kArgPointer,
+		kArgDouble,
+		kArgChar,
+		kArgString,    // uint16_t长度 + 字符串内容
+	};
+
+	// 保证还能写入len字节，写不下时换到堆上更大的存储，超过kMaxLineSize后不再扩大
+	// append()总要求avail() > len，所以留出了多一个字节
+	void ensure(int len)
+	{
+		if (__builtin_expect(buffer_.avail() <= len, 0)) {
+			grow(len);
+		}
+	}
+	void grow(int len);
+
+	// 总是给结束标记留一个字节
+	template<typename V>
+	void appendArg(char type, V v)
+	{
+		ensure(static_cast<int>(1 + sizeof v));
+		if (buffer_.avail() > static_cast<int>(1 + sizeof v)) {
+			char* p = buffer_.current();
+			*p = type;
+			memcpy(p + 1, &v, sizeof v);
+			buffer_.add(1 + sizeof v);
+		}
+	}
+
+	// 长度只有16位，更长的字符串拆成几个连续的参数，格式化时首尾相接
+	void appendStringArg(const char* data, size_t len)
+	{
+		do {
+			uint16_t n = static_cast<uint16_t>(len > 0xFFFF ? 0xFFFF : len);
+			ensure(static_cast<int>(1 + sizeof n + n));
+			if (buffer_.avail() <= static_cast<int>(1 + sizeof n + n)) {
+				return;
+			}
+			char* p = buffer_.current();
+			*p = kArgString;
+			memcpy(p + 1, &n, sizeof n);
+			memcpy(p + 1 + sizeof n, data, n);
+			buffer_.add(1 + sizeof n + n);
+			data += n;
+			len -= n;
+		} while (len > 0);
+	}
+
 	// 静态检查，用于检查一些类型的大小 
 	void staticCheck();
 
@@ -202,7 +522,9 @@ private:
 	template<typename T>
 	void formatInteger(T);
 
+	std::unique_ptr<char[]> storage_;
 	Buffer buffer_;
+	bool deferred_;
 
 	static const int kMaxNumericSize = 32;
 };
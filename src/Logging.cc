@@ -37,6 +37,12 @@ class LoggerImpl
 __thread char t_errnobuf[512]; // 存储errno描述信息
 __thread char t_time[64];      // 存储格式化后的时间信息
 __thread time_t t_lastSecond;  // 记录上一次记录的时间,在Impl的formatTime()中使用,如果时间不同才更新
+__thread Logger::LogLevel t_outputLevel = Logger::INFO; // 正在输出的日志级别
+__thread char t_line[detail::kSmallBuffer];   // 没有预留空间时在这里格式化，代替原来栈上的4000字节
+__thread bool t_lineInUse;                    // 正在格式化一条日志，嵌套的日志另找地方
+__thread int t_recordTid;            // formatRecord()上一次格式化的tid
+__thread char t_recordTidString[32];
+__thread int t_recordTidLength;
 
 const char* strerror_tl(int savedErrno)
 {
@@ -107,31 +113,29 @@ void defaultFlush()
 
 Logger::OutputFunc g_output = defaultOutput;  // 日志输出
 Logger::FlushFunc g_flush = defaultFlush;     // 日志刷新
+Logger::ReserveFunc g_reserve = NULL;         // 零拷贝输出，NULL表示不用
+Logger::CommitFunc g_commit = NULL;
 TimeZone g_logTimeZone;                       // 时区信息
+bool g_deferredFormatting = false;            // 输出二进制记录，由输出端格式化
 
+// deferred模式下每条记录的头部，后面跟着LogStream记录的参数
+struct RecordHeader
+{
+	char magic;              // Logger::kRecordMagic
+	uint8_t level;
+	uint16_t fileLength;
+	int32_t line;
+	int32_t tid;
+	int64_t microSecondsSinceEpoch;
+	const char* file;        // SourceFile指向的是__FILE__字符串常量，一直有效
+};
 
-
-
-
-Logger::Impl::Impl(LogLevel level, int savedErrno, const SourceFile& file, int line)
-	: time_(Timestamp::now()),
-	  stream_(),
-	  level_(level),
-	  line_(line),
-	  basename_(file)
+namespace
 {
-	formatTime();
-	CurrentThread::tid();
-	stream_ << T(CurrentThread::tidString(), CurrentThread::tidStringLength());
-	stream_ << T(LogLevelName[level], 6);
-	if (savedErrno != 0) {
-		stream_ << strerror_tl(savedErrno) << " (errno=" << savedErrno << ") ";
-	}
-}
 
-void Logger::Impl::formatTime()
+// 把时间格式化到stream，每个线程缓存到秒的部分，只在本文件中使用
+void formatTime(LogStream& stream, int64_t microSecondsSinceEpoch)
 {
-	int64_t microSecondsSinceEpoch = time_.microSecondsSinceEpoch();
 	time_t seconds = static_cast<time_t>(microSecondsSinceEpoch / Timestamp::kMicroSecondsPerSecond);
 	int microseconds = static_cast<int>(microSecondsSinceEpoch % Timestamp::kMicroSecondsPerSecond);
 	if (seconds != t_lastSecond) {
@@ -153,16 +157,106 @@ void Logger::Impl::formatTime()
 	if (g_logTimeZone.valid()) {
 		Fmt us(".%06d ", microseconds);
 		assert(us.length() == 8);
-		stream_ << T(t_time, 17) << T(us.data(), 8);
+		stream << T(t_time, 17) << T(us.data(), 8);
 	} else {
 		Fmt us(".%06dZ ", microseconds);
 		assert(us.length() == 9);
-		stream_ << T(t_time, 17) << T(us.data(), 9);
+		stream << T(t_time, 17) << T(us.data(), 9);
+	}
+}
+
+}  // namespace
+
+
+
+
+
+Logger::Impl::Impl(LogLevel level, int savedErrno, const SourceFile& file, int line)
+	: time_(Timestamp::now()),
+	  reserved_(NULL),
+	  heap_(),
+	  stream_(acquireStorage(), detail::kSmallBuffer),
+	  level_(level),
+	  line_(line),
+	  basename_(file)
+{
+	if (g_deferredFormatting) {
+		RecordHeader header;
+		memset(&header, 0, sizeof header);
+		header.magic = Logger::kRecordMagic;
+		header.level = static_cast<uint8_t>(level);
+		header.fileLength = static_cast<uint16_t>(file.size_);
+		header.line = line;
+		header.tid = CurrentThread::tid();
+		header.microSecondsSinceEpoch = time_.microSecondsSinceEpoch();
+		header.file = file.data_;
+		stream_.append(reinterpret_cast<const char*>(&header), sizeof header);
+		stream_.setDeferred(true);
+		if (savedErrno != 0) {
+			stream_ << strerror_tl(savedErrno) << " (errno=" << savedErrno << ") ";
+		}
+		return;
+	}
+
+	formatTime();
+	CurrentThread::tid();
+	stream_ << T(CurrentThread::tidString(), CurrentThread::tidStringLength());
+	stream_ << T(LogLevelName[level], 6);
+	if (savedErrno != 0) {
+		stream_ << strerror_tl(savedErrno) << " (errno=" << savedErrno << ") ";
+	}
+}
+
+Logger::Impl::~Impl()
+{
+	if (!heap_) {
+		t_lineInUse = false;
 	}
 }
 
+char* Logger::Impl::acquireStorage()
+{
+	if (t_lineInUse) {
+		heap_.reset(new char[detail::kSmallBuffer]);
+		return heap_.get();
+	}
+	t_lineInUse = true;
+	if (g_reserve) {
+		reserved_ = g_reserve(detail::kSmallBuffer);
+		if (reserved_) {
+			return reserved_;
+		}
+	}
+	return t_line;
+}
+
+void Logger::Impl::output()
+{
+	const LogStream::Buffer& buf(stream_.buffer());
+	t_outputLevel = level_;
+	if (reserved_ && stream_.spilled(reserved_)) {
+		// 超长的一行已经搬到堆上，预留的空间不用了
+		g_commit(reserved_, 0);
+		g_output(buf.data(), buf.length());
+	} else if (reserved_) {
+		g_commit(buf.data(), buf.length());
+	} else {
+		g_output(buf.data(), buf.length());
+	}
+}
+
+void Logger::Impl::formatTime()
+{
+	::formatTime(stream_, time_.microSecondsSinceEpoch());
+}
+
 void Logger::Impl::finish()
 {
+	// deferred模式下文件名和行号已经在记录头部
+	if (stream_.deferred()) {
+		stream_.endDeferred();
+		return;
+	}
 	stream_ << " - " << basename_ << ':' << line_ << '\n';
 }
 
@@ -190,8 +284,7 @@ Logger::Logger(SourceFile file, int line, bool toAbort)
 Logger::~Logger()
 {
 	impl_.finish();
-	const LogStream::Buffer& buf(stream().buffer());
-	g_output(buf.data(), buf.length());
+	impl_.output();
 	if (impl_.level_ == FATAL) {
 		g_flush();
 		abort();
@@ -203,9 +296,23 @@ void Logger::setLogLevel(Logger::LogLevel level)
 	g_logLevel = level;
 }
 
+Logger::LogLevel Logger::outputLevel()
+{
+	return t_outputLevel;
+}
+
 void Logger::setOutput(OutputFunc out)
 {
 	g_output = out;
+	g_reserve = NULL;
+	g_commit = NULL;
+}
+
+void Logger::setOutput(OutputFunc output, ReserveFunc reserve, CommitFunc commit)
+{
+	g_output = output;
+	g_reserve = commit ? reserve : NULL;
+	g_commit = commit;
 }
 
 void Logger::setFlush(FlushFunc flush)
@@ -213,7 +320,70 @@ void Logger::setFlush(FlushFunc flush)
 	g_flush = flush;
 }
 
+Logger::FlushFunc Logger::flushFunc()
+{
+	return g_flush;
+}
+
 void Logger::setTimeZone(const TimeZone& tz)
 {
 	g_logTimeZone = tz;
 }
+
+void Logger::setDeferredFormatting(bool on)
+{
+	g_deferredFormatting = on;
+}
+
+bool Logger::deferredFormatting()
+{
+	return g_deferredFormatting;
+}
+
+const char* Logger::parseRecord(const char* record, const char* end, Record* r)
+{
+	RecordHeader header;
+	if (end - record < static_cast<ptrdiff_t>(sizeof header)) {
+		return NULL;
+	}
+	memcpy(&header, record, sizeof header);
+	if (header.magic != kRecordMagic || header.level >= NUM_LOG_LEVELS) {
+		return NULL;
+	}
+	const char* args = record + sizeof header;
+	const char* next = LogStream::skipDeferred(args, end);
+	if (next) {
+		r->microSecondsSinceEpoch = header.microSecondsSinceEpoch;
+		r->tid = header.tid;
+		r->level = static_cast<LogLevel>(header.level);
+		r->file = StringPiece(header.file, header.fileLength);
+		r->line = header.line;
+		r->args = args;
+		r->argsEnd = next;
+	}
+	return next;
+}
+
+// 和Impl的构造函数、finish()输出的格式一致
+void Logger::formatRecord(const Record& r, LogStream& stream)
+{
+	::formatTime(stream, r.microSecondsSinceEpoch);
+	if (r.tid != t_recordTid) {
+		t_recordTid = r.tid;
+		t_recordTidLength = snprintf(t_recordTidString, sizeof t_recordTidString, "%5d ", r.tid);
+	}
+	stream << T(t_recordTidString, t_recordTidLength);
+	stream << T(LogLevelName[r.level], 6);
+	stream.formatDeferred(r.args, r.argsEnd);
+	stream << " - " << r.file << ':' << r.line << '\n';
+}
+
+const char* Logger::formatRecord(const char* record, const char* end, LogStream& stream)
+{
+	Record r;
+	const char* next = parseRecord(record, end, &r);
+	if (next) {
+		formatRecord(r, stream);
+	}
+	return next;
+}
@@ -9,6 +9,8 @@
 #include "LogStream.h"
 #include "Timestamp.h"
 
+#include <memory>
+
 
 class TimeZone;
 
@@ -72,12 +74,54 @@ public:
 	static LogLevel logLevel();
 	static void setLogLevel(LogLevel level);
 
+	// 正在交给OutputFunc输出的这条日志的级别，只在OutputFunc中调用才有意义
+	static LogLevel outputLevel();
+
 	typedef void (*OutputFunc)(const char* msg, int len); // 输出的控制函数,默认输出到stdout
 	typedef void (*FlushFunc)(); // 刷新的回调函数,默认刷新标准输出
 	static void setOutput(OutputFunc);
+
+	// 零拷贝输出：每条日志先用reserve(maxLen)向输出端要maxLen字节的可写空间，直接在其中格式化，
+	// 结束时用commit(data, len)提交实际长度，省掉从栈上缓冲区到输出端的一次拷贝；
+	// reserve返回NULL时这条日志照常格式化后交给output，比如AsyncLogging::reserve()
+	// 格式化一条日志的过程中又写日志时，里面那条不预留空间，也交给output
+	typedef char* (*ReserveFunc)(int maxLen);
+	typedef void (*CommitFunc)(const char* data, int len);
+	static void setOutput(OutputFunc output, ReserveFunc reserve, CommitFunc commit);
 	static void setFlush(FlushFunc);
+	static FlushFunc flushFunc();
 	static void setTimeZone(const TimeZone& tz);
 
+	// 延迟格式化：日志不在调用线程格式化成文本，OutputFunc收到的是二进制记录，
+	// 只记录时间戳、tid、级别、文件名指针、行号和各参数的原始值，由输出端调用formatRecord()还原
+	// 只能和能识别这种记录的OutputFunc一起使用，比如开启了setDeferredFormatting()的AsyncLogging
+	static void setDeferredFormatting(bool on);
+	static bool deferredFormatting();
+
+	// 二进制记录的第一个字节，不会出现在文本日志行的开头
+	static const char kRecordMagic = '\xFE';
+
+	// deferred模式下一条二进制记录的内容
+	struct Record
+	{
+		int64_t microSecondsSinceEpoch;
+		int tid;
+		LogLevel level;
+		StringPiece file;
+		int line;
+		const char* args;      // LogStream记录的参数
+		const char* argsEnd;   // 参数结束标记之后
+	};
+
+	// 解析record开始的一条二进制记录，返回这条记录之后的位置，数据不完整时返回NULL
+	static const char* parseRecord(const char* record, const char* end, Record* r);
+
+	// 把一条记录格式化成和普通模式相同的文本追加到stream
+	static void formatRecord(const Record& r, LogStream& stream);
+
+	// parseRecord() + formatRecord()
+	static const char* formatRecord(const char* record, const char* end, LogStream& stream);
+
 private:
 
 	// 将日志事件(时间 日志级别 文件名 行号等)信息加到输出缓冲区
@@ -86,10 +130,17 @@ private:
 	public:
 		typedef Logger::LogLevel LogLevel;
 		Impl(LogLevel level, int old_errno, const SourceFile& file, int line);
+		~Impl();
 		void formatTime(); // 格式化时间到输出缓冲区
 		void finish();        // 结束后,给输出缓冲区加上basename_和行数
+		void output();        // 交给OutputFunc或者提交预留的空间
+
+		// stream_格式化用的内存：输出端预留的空间、线程私有的缓冲区，嵌套写日志时临时分配
+		char* acquireStorage();
 
 		Timestamp time_;
+		char* reserved_;                 // ReserveFunc预留的空间，NULL表示没有预留
+		std::unique_ptr<char[]> heap_;   // 线程私有的缓冲区正在使用时临时分配
 		LogStream stream_;
 		LogLevel level_;
 		int line_;
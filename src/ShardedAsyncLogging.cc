@@ -0,0 +1,117 @@
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+#include "ShardedAsyncLogging.h"
+
+#include "CurrentThread.h"
+#include "Thread.h"
+#include "Timestamp.h"
+
+#include <stdio.h>
+
+__thread int ShardedAsyncLogging::t_channel_ = -1;
+
+ShardedAsyncLogging::ShardedAsyncLogging(const string& basename,
+                                         off_t rollSize,
+                                         int shards,
+                                         int flushInterval,
+                                         int bufferSize,
+                                         int poolBuffers)
+	: pendingBytes_(0),
+	  running_(false)
+{
+	assert(shards > 0);
+	for (int i = 0; i < shards; ++i) {
+		char suffix[16];
+		snprintf(suffix, sizeof suffix, "%d", i);
+		shards_.emplace_back(new AsyncLogging(basename + suffix, rollSize, flushInterval,
+		                                      bufferSize, poolBuffers));
+		shards_.back()->setSharedBudget(&pendingBytes_);
+	}
+	setOverflowPolicy(AsyncLogging::kDropNewest, 25 * static_cast<int64_t>(bufferSize) * shards);
+}
+
+ShardedAsyncLogging::~ShardedAsyncLogging()
+{
+	if (running_) {
+		stop();
+	}
+}
+
+void ShardedAsyncLogging::setOverflowPolicy(AsyncLogging::OverflowPolicy policy, int64_t maxPendingBytes)
+{
+	assert(!running_);
+	for (auto& shard : shards_) {
+		shard->setOverflowPolicy(policy, maxPendingBytes);
+	}
+}
+
+int ShardedAsyncLogging::threadShard() const
+{
+	return shardOf(t_channel_ >= 0 ? t_channel_ : CurrentThread::tid());
+}
+
+void ShardedAsyncLogging::start()
+{
+	running_ = true;
+	for (auto& shard : shards_) {
+		shard->start();
+	}
+}
+
+// 依次停止时后面的分片要等前面的写完，超过期限的部分会累加，
+// 所以除了第0个分片都由临时线程同时停止，每个分片从同一时刻开始计算期限
+ShardedAsyncLogging::StopReport ShardedAsyncLogging::stop(double timeoutSeconds)
+{
+	Timestamp begin = Timestamp::now();
+	std::vector<StopReport> reports(shards_.size());
+	std::vector<std::unique_ptr<Thread>> stoppers;
+	for (size_t i = 1; i < shards_.size(); ++i) {
+		stoppers.emplace_back(new Thread(std::bind(&ShardedAsyncLogging::stopShard, this,
+		                                           static_cast<int>(i), timeoutSeconds, &reports[i]),
+		                                 "ShardStop"));
+		stoppers.back()->start();
+	}
+	stopShard(0, timeoutSeconds, &reports[0]);
+	for (auto& stopper : stoppers) {
+		stopper->join();
+	}
+
+	StopReport report = { 0, 0, false, 0 };
+	for (const auto& one : reports) {
+		report.flushedBytes += one.flushedBytes;
+		report.droppedBytes += one.droppedBytes;
+		report.timedOut = report.timedOut || one.timedOut;
+	}
+	running_ = false;
+	report.seconds = timeDifference(Timestamp::now(), begin);
+	return report;
+}
+
+void ShardedAsyncLogging::stopShard(int i, double timeoutSeconds, StopReport* report)
+{
+	*report = shards_[i]->stop(timeoutSeconds);
+}
+
+ShardedAsyncLogging::Stats ShardedAsyncLogging::stats() const
+{
+	Stats total = shards_[0]->stats();
+	for (size_t i = 1; i < shards_.size(); ++i) {
+		Stats s = shards_[i]->stats();
+		total.appendedBytes += s.appendedBytes;
+		total.appendedLines += s.appendedLines;
+		total.writtenBytes += s.writtenBytes;
+		total.droppedBytes += s.droppedBytes;
+		total.emergencyAllocations += s.emergencyAllocations;
+		total.queuedBuffers += s.queuedBuffers;
+		total.pendingBytes += s.pendingBytes;
+		total.rolls += s.rolls;
+		total.backendWakeups += s.backendWakeups;
+		total.hugePageAdvised += s.hugePageAdvised;
+		total.lockedBuffers += s.lockedBuffers;
+		if (total.lastFlush < s.lastFlush) {
+			total.lastFlush = s.lastFlush;
+		}
+	}
+	return total;
+}
@@ -0,0 +1,91 @@
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+#ifndef SHARDEDASYNCLOGGING_H
+#define SHARDEDASYNCLOGGING_H
+
+#include "AsyncLogging.h"
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+// N个独立的AsyncLogging，每个有自己的buffer、后台线程和一组roll出的文件"basename<i>.时间..."
+// 一个后台线程的格式化、拷贝和写文件跟不上生产者时用，按线程或channel把生产者分到各分片
+// 同一线程(或channel)的日志都在同一组文件中并保持顺序，不同分片之间没有先后顺序
+// 所有分片共用一个积压上限，限制的是交给后台线程还没写完的字节数，不包括预先分配的buffer：
+// 每个分片另有poolBuffers + kHeldBuffers个buffer，积压先放在池里的buffer中，池空了才临时分配，
+// 整体内存大约是max(积压上限, shards * poolBuffers * bufferSize) + shards * kHeldBuffers * bufferSize，
+// 要按积压上限控制内存时，poolBuffers取积压上限 / shards / bufferSize
+class ShardedAsyncLogging : noncopyable
+{
+public:
+	typedef AsyncLogging::Stats Stats;
+	typedef AsyncLogging::StopReport StopReport;
+
+	// 每个分片的参数和AsyncLogging相同，积压上限默认为shards * 25个buffer，按kDropNewest处理
+	ShardedAsyncLogging(const string& basename,
+	                    off_t rollSize,
+	                    int shards,
+	                    int flushInterval = 3,
+	                    int bufferSize = detail::kLargeBuffer,
+	                    int poolBuffers = AsyncLogging::kDefaultPoolBuffers);
+
+	~ShardedAsyncLogging();
+
+	// 写到本线程的分片：setThreadChannel()指定过就按channel，否则按线程id
+	void append(const char* logline, int len)
+	{
+		shards_[threadShard()]->append(logline, len);
+	}
+
+	// 写到channel对应的分片，同一channel的日志在同一组文件中
+	void append(int channel, const char* logline, int len)
+	{
+		shards_[shardOf(channel)]->append(logline, len);
+	}
+
+	// 之后本线程append(logline, len)写到channel对应的分片，channel小于0时恢复按线程id
+	static void setThreadChannel(int channel)
+	{
+		t_channel_ = channel;
+	}
+
+	// 所有分片共用maxPendingBytes字节的积压上限，必须在start()之前调用
+	void setOverflowPolicy(AsyncLogging::OverflowPolicy policy, int64_t maxPendingBytes);
+
+	int shards() const
+	{
+		return static_cast<int>(shards_.size());
+	}
+
+	// 在start()之前用来设置其他选项，每个分片都要设置
+	AsyncLogging& shard(int i)
+	{
+		return *shards_[i];
+	}
+
+	void start();
+
+	// 各分片同时停止，timeoutSeconds是所有分片共同的期限，返回的报告是各分片的总和
+	StopReport stop(double timeoutSeconds = 0);
+
+	// 各分片stats()的总和，lastFlush取最近的
+	Stats stats() const;
+
+private:
+	int shardOf(int channel) const
+	{
+		return static_cast<int>(static_cast<unsigned>(channel) % shards_.size());
+	}
+	int threadShard() const;
+	void stopShard(int i, double timeoutSeconds, StopReport* report);
+
+	std::vector<std::unique_ptr<AsyncLogging>> shards_;
+	std::atomic<int64_t> pendingBytes_;   // 所有分片的积压总和
+	bool running_;
+
+	static __thread int t_channel_;
+};
+
+#endif  // SHARDEDASYNCLOGGING_H
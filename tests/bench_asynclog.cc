@@ -0,0 +1,324 @@
+//
+//  bench_asynclog.cc
+//  bench_asynclog
+//
+//  多线程写日志的吞吐量测试，扫描生产者线程数、每行内容长度、roll大小和写文件方式，
+//  每种组合输出一行CSV或一个JSON对象：吞吐量、每次LOG_INFO的延迟分位数、每行消耗的CPU时间
+//
+//  用法: bench_asynclog [--threads=1,4,8] [--sizes=16,128,1024,4096] [--rolls=64M]
+//                       [--backends=writev,io_uring,direct,compressed]
+//                       [--bytes=256M] [--max-lines=1000000] [--format=csv|json] [--keep]
+//
+
+#include "AsyncLogging.h"
+#include "LatencyHistogram.h"
+#include "Logging.h"
+#include "Thread.h"
+#include "TimeStamp.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <glob.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+namespace
+{
+
+struct Options
+{
+	std::vector<int64_t> threads;
+	std::vector<int64_t> sizes;
+	std::vector<int64_t> rolls;
+	std::vector<string> backends;
+	int64_t bytesPerRun;
+	int64_t maxLines;
+	bool json;
+	bool keep;
+};
+
+struct Result
+{
+	int threads;
+	int size;
+	int64_t rollSize;
+	string backend;
+	int64_t lines;
+	double seconds;
+	LatencyHistogram::Snapshot latency;
+	double cpuSeconds;
+	int64_t writtenBytes;
+	int64_t droppedBytes;
+};
+
+const char* kBasename = "bench_log_";
+
+AsyncLogging* g_asyncLog = NULL;
+
+void asyncOutput(const char* msg, int len)
+{
+	g_asyncLog->append(msg, len);
+}
+
+// 解析"64M"、"4K"、"1G"这样的大小
+int64_t parseSize(const string& s)
+{
+	char* end = NULL;
+	int64_t n = strtoll(s.c_str(), &end, 10);
+	switch (*end) {
+	case 'k': case 'K': n <<= 10; break;
+	case 'm': case 'M': n <<= 20; break;
+	case 'g': case 'G': n <<= 30; break;
+	default: break;
+	}
+	return n;
+}
+
+std::vector<string> split(const string& s)
+{
+	std::vector<string> items;
+	size_t begin = 0;
+	while (begin <= s.size()) {
+		size_t comma = s.find(',', begin);
+		if (comma == string::npos) {
+			comma = s.size();
+		}
+		if (comma > begin) {
+			items.push_back(s.substr(begin, comma - begin));
+		}
+		begin = comma + 1;
+	}
+	return items;
+}
+
+// 有不是正数的项时返回空，由parseOptions()拒绝，后面会用它们做除数
+std::vector<int64_t> splitSizes(const string& s)
+{
+	std::vector<int64_t> sizes;
+	for (const string& item : split(s)) {
+		int64_t size = parseSize(item);
+		if (size <= 0) {
+			return std::vector<int64_t>();
+		}
+		sizes.push_back(size);
+	}
+	return sizes;
+}
+
+double cpuSeconds()
+{
+	struct rusage usage;
+	::getrusage(RUSAGE_SELF, &usage);
+	return static_cast<double>(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+	       static_cast<double>(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+void removeLogFiles()
+{
+	glob_t files;
+	string pattern = string(kBasename) + "*";
+	if (::glob(pattern.c_str(), 0, NULL, &files) == 0) {
+		for (size_t i = 0; i < files.gl_pathc; ++i) {
+			::unlink(files.gl_pathv[i]);
+		}
+		::globfree(&files);
+	}
+}
+
+bool configureBackend(AsyncLogging& log, const string& backend)
+{
+	if (backend == "writev") {
+		return true;
+	} else if (backend == "io_uring") {
+		log.setIoUring(8);
+		return true;
+	} else if (backend == "direct") {
+		log.setDirectIo(true);
+		return true;
+	} else if (backend == "compressed") {
+		log.setFrameCompression(1);
+		return true;
+	}
+	return false;
+}
+
+// 一种组合跑一次，kBlock保证不丢日志，测到的是持续吞吐量
+bool runOnce(const Options& options, int threadNum, int size, int64_t rollSize,
+             const string& backend, Result* result)
+{
+	int64_t lines = options.bytesPerRun / size;
+	if (lines > options.maxLines) {
+		lines = options.maxLines;
+	}
+	int64_t linesPerThread = lines / threadNum > 0 ? lines / threadNum : 1;
+
+	AsyncLogging log(kBasename, rollSize, 1, detail::kLargeBuffer, 4 + 2 * threadNum + 8);
+	if (!configureBackend(log, backend)) {
+		fprintf(stderr, "unknown backend %s\n", backend.c_str());
+		return false;
+	}
+	log.setOverflowPolicy(AsyncLogging::kBlock, 25 * static_cast<int64_t>(detail::kLargeBuffer));
+	log.setBlockTimeout(60);
+	Logger::setOutput(asyncOutput);
+	g_asyncLog = &log;
+	log.start();
+
+	string payload(size, 'x');
+	LatencyHistogram latency;
+	double cpuBegin = cpuSeconds();
+	Timestamp begin = Timestamp::now();
+
+	std::vector<std::unique_ptr<Thread>> threads;
+	for (int t = 0; t < threadNum; ++t) {
+		threads.emplace_back(new Thread([&payload, &latency, linesPerThread] {
+			StringPiece piece(payload);
+			for (int64_t i = 0; i < linesPerThread; ++i) {
+				int64_t start = LatencyHistogram::now();
+				LOG_INFO << piece;
+				latency.record(LatencyHistogram::now() - start);
+			}
+		}));
+		threads.back()->start();
+	}
+	for (auto& thr : threads) {
+		thr->join();
+	}
+	log.stop();
+
+	result->threads = threadNum;
+	result->size = size;
+	result->rollSize = rollSize;
+	result->backend = backend;
+	result->lines = linesPerThread * threadNum;
+	result->seconds = timeDifference(Timestamp::now(), begin);
+	result->cpuSeconds = cpuSeconds() - cpuBegin;
+	result->latency = latency.snapshot();
+	AsyncLogging::Stats stats = log.stats();
+	result->writtenBytes = stats.writtenBytes;
+	result->droppedBytes = stats.droppedBytes;
+
+	g_asyncLog = NULL;
+	if (!options.keep) {
+		removeLogFiles();
+	}
+	return true;
+}
+
+const char* kCsvHeader =
+	"threads,payload_bytes,roll_bytes,backend,lines,seconds,lines_per_sec,mb_per_sec,"
+	"p50_ns,p99_ns,p999_ns,max_ns,cpu_ns_per_line,written_bytes,dropped_bytes";
+
+void printResult(const Result& r, bool json, bool first)
+{
+	double linesPerSec = static_cast<double>(r.lines) / r.seconds;
+	double mbPerSec = static_cast<double>(r.writtenBytes) / r.seconds / (1024 * 1024);
+	double cpuPerLine = r.cpuSeconds * 1e9 / static_cast<double>(r.lines);
+	if (json) {
+		printf("%s  {\"threads\": %d, \"payload_bytes\": %d, \"roll_bytes\": %lld, \"backend\": \"%s\", "
+		       "\"lines\": %lld, \"seconds\": %.3f, \"lines_per_sec\": %.0f, \"mb_per_sec\": %.1f, "
+		       "\"p50_ns\": %lld, \"p99_ns\": %lld, \"p999_ns\": %lld, \"max_ns\": %lld, "
+		       "\"cpu_ns_per_line\": %.0f, \"written_bytes\": %lld, \"dropped_bytes\": %lld}",
+		       first ? "" : ",\n", r.threads, r.size, static_cast<long long>(r.rollSize), r.backend.c_str(),
+		       static_cast<long long>(r.lines), r.seconds, linesPerSec, mbPerSec,
+		       static_cast<long long>(r.latency.percentile(50)),
+		       static_cast<long long>(r.latency.percentile(99)),
+		       static_cast<long long>(r.latency.percentile(99.9)),
+		       static_cast<long long>(r.latency.max()),
+		       cpuPerLine, static_cast<long long>(r.writtenBytes), static_cast<long long>(r.droppedBytes));
+	} else {
+		printf("%d,%d,%lld,%s,%lld,%.3f,%.0f,%.1f,%lld,%lld,%lld,%lld,%.0f,%lld,%lld\n",
+		       r.threads, r.size, static_cast<long long>(r.rollSize), r.backend.c_str(),
+		       static_cast<long long>(r.lines), r.seconds, linesPerSec, mbPerSec,
+		       static_cast<long long>(r.latency.percentile(50)),
+		       static_cast<long long>(r.latency.percentile(99)),
+		       static_cast<long long>(r.latency.percentile(99.9)),
+		       static_cast<long long>(r.latency.max()),
+		       cpuPerLine, static_cast<long long>(r.writtenBytes), static_cast<long long>(r.droppedBytes));
+	}
+	fflush(stdout);
+}
+
+bool parseOptions(int argc, char* argv[], Options* options)
+{
+	options->threads = splitSizes("1,4,8");
+	options->sizes = splitSizes("16,128,1024,4096");
+	options->rolls = splitSizes("64M");
+	options->backends = split("writev");
+	options->bytesPerRun = parseSize("256M");
+	options->maxLines = 1000 * 1000;
+	options->json = false;
+	options->keep = false;
+
+	for (int i = 1; i < argc; ++i) {
+		string arg(argv[i]);
+		size_t eq = arg.find('=');
+		string name = arg.substr(0, eq);
+		string value = eq == string::npos ? string() : arg.substr(eq + 1);
+		if (name == "--threads") {
+			options->threads = splitSizes(value);
+		} else if (name == "--sizes") {
+			options->sizes = splitSizes(value);
+		} else if (name == "--rolls") {
+			options->rolls = splitSizes(value);
+		} else if (name == "--backends") {
+			options->backends = split(value);
+		} else if (name == "--bytes") {
+			options->bytesPerRun = parseSize(value);
+		} else if (name == "--max-lines") {
+			options->maxLines = parseSize(value);
+		} else if (name == "--format") {
+			options->json = value == "json";
+		} else if (name == "--keep") {
+			options->keep = true;
+		} else {
+			return false;
+		}
+	}
+	return !options->threads.empty() && !options->sizes.empty() &&
+	       !options->rolls.empty() && !options->backends.empty() &&
+	       options->bytesPerRun > 0 && options->maxLines > 0;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[])
+{
+	Options options;
+	if (!parseOptions(argc, argv, &options)) {
+		fprintf(stderr, "Usage: %s [--threads=1,4,8] [--sizes=16,128,1024,4096] [--rolls=64M]\n"
+		                "       [--backends=writev,io_uring,direct,compressed]\n"
+		                "       [--bytes=256M] [--max-lines=1000000] [--format=csv|json] [--keep]\n",
+		        argv[0]);
+		return 1;
+	}
+
+	if (options.json) {
+		printf("[\n");
+	} else {
+		printf("%s\n", kCsvHeader);
+	}
+	bool first = true;
+	for (const string& backend : options.backends) {
+		for (int64_t rollSize : options.rolls) {
+			for (int64_t size : options.sizes) {
+				for (int64_t threadNum : options.threads) {
+					Result result;
+					if (!runOnce(options, static_cast<int>(threadNum), static_cast<int>(size),
+					             rollSize, backend, &result)) {
+						return 1;
+					}
+					printResult(result, options.json, first);
+					first = false;
+				}
+			}
+		}
+	}
+	if (options.json) {
+		printf("\n]\n");
+	}
+	return 0;
+}
@@ -0,0 +1,119 @@
+//
+//  log_decoder.cc
+//  log_decoder
+//
+//  把AsyncLogging::setBinaryFormat()写出的二进制日志还原成文本，输出到stdout
+//  setFrameCompression()压缩过的文件先解压；普通文本日志原样输出
+//  用法: log_decoder file...
+//
+
+
+#include "BinaryLog.h"
+#include "FrameCompressor.h"
+
+#include <memory>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+static const size_t kChunkSize = 4 * 1024 * 1024;
+
+// 分块读入文件，先解压完整的帧，再解码完整的二进制帧，不完整的留到下一块
+static int decodeFile(const char* filename)
+{
+	int fd = ::open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+		return 1;
+	}
+
+	FrameDecompressor decompressor;
+	BinaryLogDecoder decoder;
+	string input;   // 读入的文件内容
+	string raw;     // 解压后的内容
+	string output;
+	bool started = false;
+	bool compressed = false;
+	bool binary = false;
+	std::unique_ptr<char[]> chunk(new char[kChunkSize]);
+	int ret = 0;
+	for (;;) {
+		ssize_t n = ::read(fd, chunk.get(), kChunkSize);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+			ret = 1;
+			break;
+		}
+		if (n == 0) {
+			if (!started) {
+				// 不到一个文件头长的文本
+				fwrite(raw.data(), 1, raw.size(), stdout);
+				raw.clear();
+			}
+			if (!input.empty() || !raw.empty()) {
+				fprintf(stderr, "%s: truncated, %zu bytes left\n", filename, input.size() + raw.size());
+				ret = 1;
+			}
+			break;
+		}
+		input.append(chunk.get(), n);
+
+		if (!started) {
+			compressed = FrameDecompressor::isCompressed(input.data(), input.size());
+		}
+		if (compressed) {
+			input.erase(0, decompressor.decompress(input.data(), input.size(), &raw));
+		} else {
+			raw.append(input);
+			input.clear();
+		}
+
+		if (!started) {
+			if (raw.size() < sizeof BinaryLogEncoder::kFileMagic && (compressed || raw.empty())) {
+				continue;
+			}
+			binary = BinaryLogDecoder::isBinaryLog(raw.data(), raw.size());
+			started = true;
+		}
+		if (binary) {
+			output.clear();
+			ssize_t used = decoder.decode(raw.data(), raw.size(), &output);
+			if (used < 0) {
+				fprintf(stderr, "%s: corrupted binary log\n", filename);
+				ret = 1;
+				break;
+			}
+			fwrite(output.data(), 1, output.size(), stdout);
+			raw.erase(0, used);
+		} else {
+			fwrite(raw.data(), 1, raw.size(), stdout);
+			raw.clear();
+		}
+	}
+	if (decompressor.corruptFrames() > 0) {
+		fprintf(stderr, "%s: %lld corrupted frames skipped\n", filename,
+		        static_cast<long long>(decompressor.corruptFrames()));
+		ret = 1;
+	}
+	::close(fd);
+	return ret;
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s file...\n", argv[0]);
+		return 1;
+	}
+	int ret = 0;
+	for (int i = 1; i < argc; ++i) {
+		ret |= decodeFile(argv[i]);
+	}
+	return ret;
+}
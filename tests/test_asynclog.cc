@@ -8,15 +8,35 @@
 
 
 #include "AsyncLogging.h"
+#include "BinaryLog.h"
+#include "FrameCompressor.h"
 #include "Logging.h"
+#include "ShardedAsyncLogging.h"
+#include "Thread.h"
 #include "TimeStamp.h"
 
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include <assert.h>
+#include <inttypes.h>
+#include <glob.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <zlib.h>
 
 using std::cout;
 using std::endl;
 
 #define LOG_NUM 5000000 // 总共的写入日志行数
+#define THREAD_NUM 4      // 多线程测试的写日志线程数
 
 static AsyncLogging *g_asyncLog = NULL;
 
@@ -25,6 +45,115 @@ static void asyncOutput(const char *msg, int len)
 	g_asyncLog->append(msg, len);
 }
 
+static char *asyncReserve(int maxLen)
+{
+	return g_asyncLog->reserve(maxLen);
+}
+
+static void asyncCommit(const char *data, int len)
+{
+	g_asyncLog->commit(data, len);
+}
+
+static ShardedAsyncLogging *g_shardedLog = NULL;
+
+static void shardedOutput(const char *msg, int len)
+{
+	g_shardedLog->append(msg, len);
+}
+
+static int64_t countLines(const char* prefix);
+static void removeLogFiles(const char* prefix);
+static int64_t countLinesWith(const char* prefix, const char* needle);
+static string readLogFiles(const char* prefix);
+
+// 按log_decoder的方式还原一个日志文件：压缩过的先解压，二进制格式再解码成文本，普通文本原样返回
+static string decodeLogFile(const char* filename)
+{
+	string content;
+	FILE* fp = ::fopen(filename, "r");
+	char buf[65536];
+	size_t n;
+	while (fp && (n = fread(buf, 1, sizeof buf, fp)) > 0) {
+		content.append(buf, n);
+	}
+	if (fp) {
+		::fclose(fp);
+	}
+
+	if (FrameDecompressor::isCompressed(content.data(), content.size())) {
+		FrameDecompressor decompressor;
+		string raw;
+		decompressor.decompress(content.data(), content.size(), &raw);
+		content.swap(raw);
+	}
+	if (BinaryLogDecoder::isBinaryLog(content.data(), content.size())) {
+		BinaryLogDecoder decoder;
+		string text;
+		decoder.decode(content.data(), content.size(), &text);
+		content.swap(text);
+	}
+	return content;
+}
+
+// checkThreadOrder()的结果
+struct OrderCheck
+{
+	int64_t lines;        // "NO.i"的行数
+	int threads;          // 写了这些行的线程数
+	int64_t violations;   // 和同一线程的上一行不连续的行数
+	bool complete;        // 恰好threads个线程，每个都有linesPerThread行
+};
+
+// 按文件名(也就是roll的)顺序还原prefix开头的日志文件，"时间 tid 级别 NO.i ..."的行中，
+// 每个tid的i都应该从0开始逐个递增
+static OrderCheck checkThreadOrder(const char* prefix, int threads, int64_t linesPerThread)
+{
+	OrderCheck check = { 0, 0, 0, false };
+	std::map<int, int64_t> next;   // tid -> 下一行应有的i
+	std::map<int, int64_t> count;  // tid -> 行数，行有缺失时和next不同
+	string pattern = string(prefix) + "*";
+	glob_t files;
+	if (::glob(pattern.c_str(), 0, NULL, &files) != 0) {
+		return check;
+	}
+	for (size_t f = 0; f < files.gl_pathc; ++f) {
+		string content = decodeLogFile(files.gl_pathv[f]);
+		const char* p = content.c_str();
+		const char* end = p + content.size();
+		while (p < end) {
+			const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+			if (!eol) {
+				eol = end;
+			}
+			// 跳过日期和时间两个字段
+			const char* field = static_cast<const char*>(memchr(p, ' ', eol - p));
+			field = field ? static_cast<const char*>(memchr(field + 1, ' ', eol - field - 1)) : NULL;
+			const char* mark = field ? strstr(field, " NO.") : NULL;
+			if (mark && mark < eol) {
+				int tid = static_cast<int>(strtol(field, NULL, 10));
+				int64_t i = strtoll(mark + 4, NULL, 10);
+				int64_t& expected = next[tid];
+				if (i != expected) {
+					++check.violations;
+				}
+				expected = i + 1;
+				++count[tid];
+				++check.lines;
+			}
+			p = eol + 1;
+		}
+	}
+	::globfree(&files);
+
+	check.threads = static_cast<int>(next.size());
+	check.complete = check.threads == threads;
+	for (const auto& item : next) {
+		check.complete = check.complete && item.second == linesPerThread && count[item.first] == linesPerThread;
+	}
+	return check;
+}
+
 int test_asynclog() {
 
 	off_t kRollSize = 1 * 1000 * 1000;	  // 只设置1M
@@ -57,9 +186,1295 @@ int test_asynclog() {
 	return 0;
 }
 
+// test_asynclog_threads()的选项，默认是共享buffer，由mutex_交给后台线程，用writev写文件
+struct ThreadsOptions
+{
+	ThreadsOptions()
+		: threadLocal(false),
+		  queueSlots(0),
+		  ioUringDepth(0),
+		  directIo(false),
+		  deferred(false),
+		  binary(false),
+		  compressLevel(0),
+		  zeroCopy(false)
+	{ }
+
+	ThreadsOptions& setThreadLocal() { threadLocal = true; return *this; }
+	ThreadsOptions& setQueueSlots(int slots) { queueSlots = slots; return *this; }
+	ThreadsOptions& setIoUring(int depth) { ioUringDepth = depth; return *this; }
+	ThreadsOptions& setDirectIo() { directIo = true; return *this; }
+	ThreadsOptions& setDeferred() { deferred = true; return *this; }
+	ThreadsOptions& setBinary() { deferred = binary = true; return *this; }
+	ThreadsOptions& setCompression(int level) { compressLevel = level; return *this; }
+	ThreadsOptions& setZeroCopy() { zeroCopy = true; return *this; }
+
+	bool threadLocal;     // 每个线程使用自己的缓冲区
+	int queueSlots;       // 大于0时写满的buffer通过无锁队列交给后台线程
+	int ioUringDepth;     // 大于0时后台线程用io_uring写文件
+	bool directIo;        // 用O_DIRECT写文件
+	bool deferred;        // 生产者只记录原始参数，由后台线程格式化
+	bool binary;          // 写成二进制格式，用log_decoder还原
+	int compressLevel;    // 大于0时后台线程把每个buffer压缩成一个帧再写入
+	bool zeroCopy;        // Logger直接在线程私有缓冲区中预留的空间里格式化
+};
+
+// 多个线程同时写日志，写完后还原日志文件，检查每个线程的日志都在且顺序不变
+int test_asynclog_threads(const ThreadsOptions& opt) {
+
+	off_t kRollSize = 1 * 1000 * 1000;	  // 只设置1M
+
+	char logfile[128] = "async_log_threads_";
+	if (opt.binary) {
+		strcpy(logfile, "async_log_binary_");  // 用log_decoder还原
+	} else if (opt.compressLevel > 0) {
+		strcpy(logfile, "async_log_compressed_");
+	}
+	removeLogFiles(logfile);
+	// 每个线程换buffer时都能从池里取到
+	AsyncLogging log(logfile, kRollSize, 1, 4000 * 1000, 4 + 2 * THREAD_NUM + opt.ioUringDepth);
+	log.setThreadLocalBuffer(opt.threadLocal);
+	if (opt.queueSlots > 0) {
+		log.setLockFreeQueue(opt.queueSlots);
+	}
+	if (opt.ioUringDepth > 0) {
+		log.setIoUring(opt.ioUringDepth);
+	}
+	log.setDirectIo(opt.directIo);
+	log.setDeferredFormatting(opt.deferred);
+	log.setBinaryFormat(opt.binary);
+	Logger::setDeferredFormatting(opt.deferred);
+	log.setFrameCompression(opt.compressLevel);
+	// 格式化、压缩压在后台线程上时生产者会跑得比它快，等待而不是丢弃，一行都不能少
+	log.setOverflowPolicy(AsyncLogging::kBlock, 25 * 4000 * 1000);
+	log.setBlockTimeout(60);
+	if (opt.zeroCopy) {
+		Logger::setOutput(asyncOutput, asyncReserve, asyncCommit);
+	} else {
+		Logger::setOutput(asyncOutput);
+	}
+	g_asyncLog = &log;
+	log.start();
+
+	Timestamp begin_time = Timestamp::now();
+
+	std::vector<std::unique_ptr<Thread>> threads;
+	for (int t = 0; t < THREAD_NUM; t++) {
+		threads.emplace_back(new Thread([] {
+			for (int i = 0; i < LOG_NUM / THREAD_NUM; i++) {
+				LOG_INFO << "NO." << i << " Log Info Message!";
+			}
+		}));
+		threads.back()->start();
+	}
+	for (auto& thr : threads) {
+		thr->join();
+	}
+
+	AsyncLogging::StopReport report = log.stop();
+	Logger::setDeferredFormatting(false);
+
+	Timestamp end_time = Timestamp::now();
+	double consume_time = timeDifference(end_time, begin_time);
+
+	AsyncLogging::Stats stats = log.stats();
+	OrderCheck check = checkThreadOrder(logfile, THREAD_NUM, LOG_NUM / THREAD_NUM);
+	removeLogFiles(logfile);
+
+	cout << (opt.threadLocal ? "thread local" : "shared") << " buffer, "
+	     << (opt.queueSlots > 0 ? "lock-free queue, " : "")
+	     << (opt.ioUringDepth > 0 ? "io_uring, " : "")
+	     << (opt.directIo ? "O_DIRECT, " : "")
+	     << (opt.deferred ? "deferred formatting, " : "")
+	     << (opt.binary ? "binary format, " : "")
+	     << (opt.compressLevel > 0 ? "frame compression, " : "")
+	     << (opt.zeroCopy ? "zero copy, " : "")
+	     << THREAD_NUM << " threads: need "
+	     << consume_time << "(s)  ops:" <<  (LOG_NUM / (consume_time)) << "/s"
+	     << "  stop: " << report.flushedBytes << " bytes flushed in " << report.seconds << "(s)" << endl;
+	cout << "  " << check.lines << " lines in files from " << check.threads << " threads, "
+	     << check.violations << " out of order" << endl;
+	assert(stats.appendedLines == LOG_NUM);
+	assert(stats.droppedBytes == 0);
+	assert(check.lines == LOG_NUM && check.complete && check.violations == 0);
+
+	return 0;
+}
+
+// 线程私有缓冲区模式下不断有线程创建、写几行日志后退出
+// 退出的线程的缓冲区由后台线程回收，buffer池不会被占光，也不会丢失计数
+int test_asynclog_thread_churn() {
+
+	const int kThreads = 64;
+	const int kLines = 100;
+	char logfile[128] = "async_log_churn_";
+	AsyncLogging log(logfile, 1000 * 1000 * 1000, 1, 4000 * 1000, 8);
+	log.setThreadLocalBuffer(true);
+	Logger::setOutput(asyncOutput);
+	g_asyncLog = &log;
+	log.start();
+
+	for (int t = 0; t < kThreads; t++) {
+		Thread thread([] {
+			for (int i = 0; i < kLines; i++) {
+				LOG_INFO << "NO." << i << " Log Info Message!";
+			}
+		});
+		thread.start();
+		thread.join();
+		// 后台线程写完这一轮后回收已经退出的线程的缓冲区
+		log.emergencyFlush(1.0);
+	}
+
+	log.stop();
+	AsyncLogging::Stats stats = log.stats();
+	removeLogFiles(logfile);
+
+	cout << "thread churn, " << kThreads << " threads: " << stats.appendedLines << " lines appended, "
+	     << stats.emergencyAllocations << " emergency allocations" << endl;
+	assert(stats.appendedLines == kThreads * kLines);
+	assert(stats.emergencyAllocations < kThreads / 2);
+
+	return 0;
+}
+
+// 一个线程轮流写到线程私有缓冲区的各个分片，本线程在每个分片只注册一次
+int test_asynclog_channel_switch() {
+
+	const int kShards = 4;
+	const int kLines = 100000;
+	char logfile[128] = "async_log_switch_";
+	removeLogFiles(logfile);
+	ShardedAsyncLogging log(logfile, 1000 * 1000 * 1000, kShards, 1, 1024 * 1024, 4);
+	for (int i = 0; i < log.shards(); i++) {
+		log.shard(i).setThreadLocalBuffer(true);
+	}
+	log.start();
+
+	size_t stagings = 0;
+	Thread thread([&log, &stagings] {
+		char line[64];
+		for (int i = 0; i < kLines; i++) {
+			int len = snprintf(line, sizeof line, "NO.%d channel switch\n", i);
+			log.append(i % kShards, line, len);
+		}
+		stagings = AsyncLogging::threadStagings();
+	});
+	thread.start();
+	thread.join();
+	log.stop();
+
+	int64_t lines = countLines(logfile);
+	removeLogFiles(logfile);
+	cout << "channel switch: " << stagings << " stagings for " << kShards << " shards, "
+	     << lines << " lines" << endl;
+	assert(stagings == kShards && lines == kLines);
+
+	return 0;
+}
+
+// O_DIRECT写入时不满一块的尾部补零写出，flush之后文件应该马上截回真实长度
+// 运行中读到的文件和崩溃后留下的一样，末尾不能有补的零
+int test_asynclog_direct_tail() {
+
+	const int kLines = 1000;
+	char logfile[128] = "async_log_direct_";
+	removeLogFiles(logfile);
+	AsyncLogging log(logfile, 1000 * 1000 * 1000, 30);
+	log.setDirectIo(true);
+	Logger::setOutput(asyncOutput);
+	g_asyncLog = &log;
+	log.start();
+
+	for (int i = 0; i < kLines; i++) {
+		LOG_INFO << "NO." << i << " Log Info Message!";
+	}
+	bool flushed = log.emergencyFlush(1.0);
+	string content = readLogFiles(logfile);
+	log.stop();
+	removeLogFiles(logfile);
+
+	size_t nuls = std::count(content.begin(), content.end(), '\0');
+	size_t lines = std::count(content.begin(), content.end(), '\n');
+	cout << "O_DIRECT tail: " << content.size() << " bytes, " << lines << " lines, "
+	     << nuls << " NUL bytes after flush" << endl;
+	assert(flushed && lines == kLines && nuls == 0);
+	assert(!content.empty() && content[content.size() - 1] == '\n');
+
+	return 0;
+}
+
+// 预分配的空间在roll和stop关闭文件时要释放掉，文件长度等于写入的内容，磁盘上也不留多分配的块
+int test_asynclog_preallocate() {
+
+	const off_t kRollSize = 4 * 1024 * 1024;
+	const int kLines = 60000;
+	char logfile[128] = "async_log_prealloc_";
+	removeLogFiles(logfile);
+	AsyncLogging log(logfile, kRollSize, 30);
+	log.setPreallocate(true);
+	Logger::setOutput(asyncOutput);
+	g_asyncLog = &log;
+	log.start();
+
+	// 同一秒内不会roll，分两批写，中间等过一秒
+	for (int batch = 0; batch < 2; batch++) {
+		for (int i = 0; i < kLines; i++) {
+			LOG_INFO << "NO." << i << " Log Info Message! preallocate test padding padding";
+		}
+		log.emergencyFlush(1.0);
+		usleep(1100 * 1000);
+	}
+	log.stop();
+
+	string pattern = string(logfile) + "*";
+	glob_t files;
+	assert(::glob(pattern.c_str(), 0, NULL, &files) == 0);
+	int64_t lines = 0;
+	for (size_t i = 0; i < files.gl_pathc; ++i) {
+		struct stat st;
+		assert(::stat(files.gl_pathv[i], &st) == 0);
+		string content = readLogFiles(files.gl_pathv[i]);
+		lines += std::count(content.begin(), content.end(), '\n');
+		cout << "preallocate: " << files.gl_pathv[i] << " size " << st.st_size
+		     << " allocated " << st.st_blocks * 512 << endl;
+		// 文件长度就是内容长度，分配的块不超过长度取整到1MB（文件系统的分配粒度），预分配的4MB已经还回去
+		assert(static_cast<off_t>(content.size()) == st.st_size);
+		assert(content.find('\0') == string::npos);
+		assert(st.st_blocks * 512 <= st.st_size + 1024 * 1024);
+	}
+	assert(files.gl_pathc >= 2 && lines == 2 * kLines);
+	::globfree(&files);
+	removeLogFiles(logfile);
+
+	return 0;
+}
+
+// 写入量超过窗口后，窗口之前的部分应该已经从page cache中丢掉
+int test_asynclog_drop_cache() {
+
+	const off_t kWindow = 1024 * 1024;
+	const int kLines = 100000;
+	char logfile[128] = "async_log_dropcache_";
+	removeLogFiles(logfile);
+	AsyncLogging log(logfile, 1000 * 1000 * 1000, 30);
+	log.setDropCacheWindow(kWindow);
+	Logger::setOutput(asyncOutput);
+	g_asyncLog = &log;
+	log.start();
+
+	for (int i = 0; i < kLines; i++) {
+		LOG_INFO << "NO." << i << " Log Info Message! drop cache test";
+	}
+	log.emergencyFlush(1.0);
+	log.stop();
+
+	int64_t lines = countLines(logfile);
+	cout << "drop cache: " << log.pageCacheDroppedBytes() << " bytes dropped, window "
+	     << kWindow << ", " << lines << " lines" << endl;
+	assert(lines == kLines);
+	assert(log.pageCacheDroppedBytes() > 0);
+	removeLogFiles(logfile);
+
+	return 0;
+}
+
+// roll掉的文件被压缩成.gz并删除原文件；限速很低时stop()也要把排队的文件压缩完
+int test_asynclog_compression() {
+
+	const int kLines = 60000;
+	char logfile[128] = "async_log_gzip_";
+	removeLogFiles(logfile);
+	AsyncLogging log(logfile, 1024 * 1024, 30);
+	log.setRolledFileCompression(true, 1024 * 1024);
+	Logger::setOutput(asyncOutput);
+	g_asyncLog = &log;
+	log.start();
+
+	// 同一秒内不会roll，分两批写，中间等过一秒
+	for (int batch = 0; batch < 2; batch++) {
+		for (int i = 0; i < kLines; i++) {
+			LOG_INFO << "NO." << i << " Log Info Message! compression test";
+		}
+		log.emergencyFlush(1.0);
+		usleep(1100 * 1000);
+	}
+	log.stop();
+
+	string pattern = string(logfile) + "*";
+	glob_t files;
+	assert(::glob(pattern.c_str(), 0, NULL, &files) == 0);
+	int gzFiles = 0;
+	int64_t lines = 0;
+	for (size_t i = 0; i < files.gl_pathc; ++i) {
+		string name = files.gl_pathv[i];
+		assert(name.find(".tmp") == string::npos);
+		string content;
+		if (name.size() > 3 && name.compare(name.size() - 3, 3, ".gz") == 0) {
+			++gzFiles;
+			// 原文件已经删掉
+			assert(::access(name.substr(0, name.size() - 3).c_str(), F_OK) < 0);
+			gzFile gz = ::gzopen(name.c_str(), "rb");
+			assert(gz != NULL);
+			char buf[65536];
+			int n;
+			while ((n = ::gzread(gz, buf, sizeof buf)) > 0) {
+				content.append(buf, n);
+			}
+			assert(n == 0 && ::gzclose(gz) == Z_OK);
+		} else {
+			content = readLogFiles(name.c_str());
+		}
+		assert(content.empty() || content[content.size() - 1] == '\n');
+		lines += std::count(content.begin(), content.end(), '\n');
+	}
+	::globfree(&files);
+
+	cout << "compression: " << gzFiles << " gz files, " << log.stats().rolls << " rolls, "
+	     << lines << " lines" << endl;
+	assert(gzFiles >= 1 && gzFiles == log.stats().rolls);
+	assert(lines == 2 * kLines);
+	removeLogFiles(logfile);
+
+	return 0;
+}
+
+// 二进制格式中的参数按机器无关的编码写入，解码后要和普通模式格式化的文本完全一致
+int test_asynclog_binary_args() {
+
+	char logfile[128] = "async_log_binary_";
+	removeLogFiles(logfile);
+	AsyncLogging log(logfile, 1000 * 1000 * 1000, 30);
+	log.setDeferredFormatting(true);
+	log.setBinaryFormat(true);
+	Logger::setDeferredFormatting(true);
+	Logger::setOutput(asyncOutput);
+	g_asyncLog = &log;
+	log.start();
+
+	const string big(70000, 'x');
+	const int i = -123456;
+	const unsigned int u = 4000000000u;
+	const long l = -9000000000000000000L;
+	const unsigned long ul = 18000000000000000000UL;
+	const long long ll = -1;
+	const unsigned long long ull = 0;
+	const double d = -3.14159e-300;
+	const void* ptr = &log;
+	LOG_INFO << "args " << i << ' ' << u << ' ' << l << ' ' << ul << ' ' << ll << ' '
+	         << ull << ' ' << d << ' ' << ptr << ' ' << big << " end";
+	log.stop();
+	Logger::setDeferredFormatting(false);
+
+	LogStream expected;
+	expected << "args " << i << ' ' << u << ' ' << l << ' ' << ul << ' ' << ll << ' '
+	         << ull << ' ' << d << ' ' << ptr << ' ' << big << " end";
+	string want(expected.buffer().data(), expected.buffer().length());
+
+	string content;
+	string pattern = string(logfile) + "*";
+	glob_t files;
+	if (::glob(pattern.c_str(), 0, NULL, &files) == 0) {
+		for (size_t k = 0; k < files.gl_pathc; ++k) {
+			content += decodeLogFile(files.gl_pathv[k]);
+		}
+		::globfree(&files);
+	}
+	removeLogFiles(logfile);
+
+	bool found = content.find(want) != string::npos;
+	cout << "binary args: " << (found ? "decoded text matches" : "decoded text differs") << endl;
+	assert(found);
+
+	return 0;
+}
+
+// 开启延迟直方图，每秒写入日志文件一次，结束时打印各阶段的延迟
+int test_asynclog_latency(bool threadLocal) {
+
+	off_t kRollSize = 1 * 1000 * 1000;	  // 只设置1M
+
+	char logfile[128] = "async_log_latency_";
+	AsyncLogging log(logfile, kRollSize, 1, 4000 * 1000, 4 + 2 * THREAD_NUM);
+	log.setThreadLocalBuffer(threadLocal);
+	log.setLatencyHistograms(true, 1);
+	Logger::setOutput(asyncOutput);
+	g_asyncLog = &log;
+	log.start();
+
+	Timestamp begin_time = Timestamp::now();
+
+	std::vector<std::unique_ptr<Thread>> threads;
+	for (int t = 0; t < THREAD_NUM; t++) {
+		threads.emplace_back(new Thread([] {
+			for (int i = 0; i < LOG_NUM / THREAD_NUM; i++) {
+				LOG_INFO << "NO." << i << " Log Info Message!";
+			}
+		}));
+		threads.back()->start();
+	}
+	for (auto& thr : threads) {
+		thr->join();
+	}
+
+	log.stop();
+
+	Timestamp end_time = Timestamp::now();
+	double consume_time = timeDifference(end_time, begin_time);
+
+	cout << (threadLocal ? "thread local" : "shared") << " buffer, latency histograms, "
+	     << THREAD_NUM << " threads: need "
+	     << consume_time << "(s)  ops:" <<  (LOG_NUM / (consume_time)) << "/s" << endl;
+	const char* names[] = { "append", "lock wait", "write", "flush", "wake to write" };
+	for (int i = 0; i < AsyncLogging::kNumLatencyKinds; ++i) {
+		LatencyHistogram::Snapshot s = log.latency(static_cast<AsyncLogging::LatencyKind>(i));
+		cout << "  " << names[i] << ": " << s.toString() << endl;
+		assert(s.percentile(50) <= s.percentile(99) && s.percentile(99) <= s.max());
+	}
+	assert(log.latency(AsyncLogging::kAppendLatency).count() == LOG_NUM);
+	assert(log.latency(AsyncLogging::kWriteLatency).count() > 0);
+	assert(log.latency(AsyncLogging::kFlushLatency).count() > 0);
+	assert(log.latency(AsyncLogging::kWakeToWrite).count() > 0);
+	removeLogFiles(logfile);
+
+	return 0;
+}
+
+// 已知的值落在桶里，桶的上界和真实值相差不超过1/16，百分位数也是
+int test_latency_histogram() {
+
+	const int64_t kValues[] = { 0, 1, 15, 16, 17, 100, 1000, 4095, 4097, 123456, 1000 * 1000, 987654321 };
+	for (size_t i = 0; i < sizeof kValues / sizeof kValues[0]; ++i) {
+		int64_t v = kValues[i];
+		int64_t high = LatencyHistogram::bucketHighestValue(LatencyHistogram::bucketIndex(v));
+		assert(high >= v && (high - v) * 16 <= v);
+	}
+
+	LatencyHistogram histogram;
+	for (int64_t v = 1; v <= 1000; ++v) {
+		histogram.record(v * 1000);
+	}
+	LatencyHistogram::Snapshot s = histogram.snapshot();
+	cout << "latency histogram: " << s.toString() << endl;
+	assert(s.count() == 1000);
+	assert(s.percentile(50) >= 500 * 1000 && s.percentile(50) <= 500 * 1000 * 17 / 16);
+	assert(s.percentile(99) >= 990 * 1000 && s.percentile(99) <= 990 * 1000 * 17 / 16);
+	assert(s.max() >= 1000 * 1000 && s.max() <= 1000 * 1000 * 17 / 16);
+
+	return 0;
+}
+
+// 每个线程按channel写到自己的分片，各分片共用25个buffer的积压上限，等待而不是丢弃
+// 一个线程的日志都在同一个分片里，按文件名(分片号+roll时间)排序后每个线程的行号连续
+int test_asynclog_sharded(int shards) {
+
+	off_t kRollSize = 1 * 1000 * 1000;	  // 只设置1M
+
+	char logfile[128] = "async_log_sharded_";
+	removeLogFiles(logfile);
+	ShardedAsyncLogging log(logfile, kRollSize, shards, 1, 4000 * 1000);
+	log.setOverflowPolicy(AsyncLogging::kBlock, 25 * 4000 * 1000);
+	for (int i = 0; i < log.shards(); i++) {
+		log.shard(i).setBlockTimeout(60);
+	}
+	Logger::setOutput(shardedOutput);
+	g_shardedLog = &log;
+	log.start();
+
+	Timestamp begin_time = Timestamp::now();
+
+	std::vector<std::unique_ptr<Thread>> threads;
+	for (int t = 0; t < THREAD_NUM; t++) {
+		threads.emplace_back(new Thread([t] {
+			ShardedAsyncLogging::setThreadChannel(t);
+			for (int i = 0; i < LOG_NUM / THREAD_NUM; i++) {
+				LOG_INFO << "NO." << i << " Log Info Message!";
+			}
+		}));
+		threads.back()->start();
+	}
+	for (auto& thr : threads) {
+		thr->join();
+	}
+
+	ShardedAsyncLogging::StopReport report = log.stop();
+	g_shardedLog = NULL;
+
+	Timestamp end_time = Timestamp::now();
+	double consume_time = timeDifference(end_time, begin_time);
+
+	ShardedAsyncLogging::Stats stats = log.stats();
+	cout << shards << " shards, " << THREAD_NUM << " threads: need "
+	     << consume_time << "(s)  ops:" <<  (LOG_NUM / (consume_time)) << "/s"
+	     << "  stop: " << report.flushedBytes << " bytes flushed in " << report.seconds << "(s)" << endl;
+	OrderCheck check = checkThreadOrder(logfile, THREAD_NUM, LOG_NUM / THREAD_NUM);
+	cout << "  stats: " << stats.appendedLines << " lines appended, " << stats.droppedBytes << " bytes dropped, "
+	     << check.lines << " lines in files from " << check.threads << " threads, "
+	     << check.violations << " out of order" << endl;
+	assert(stats.appendedLines == LOG_NUM && stats.droppedBytes == 0);
+	assert(check.lines == LOG_NUM && check.complete && check.violations == 0);
+	removeLogFiles(logfile);
+
+	return 0;
+}
+
+// 读出文件名以prefix开头的所有日志文件，按文件名顺序拼在一起
+static string readLogFiles(const char* prefix)
+{
+	string pattern = string(prefix) + "*";
+	glob_t files;
+	string content;
+	if (::glob(pattern.c_str(), 0, NULL, &files) != 0) {
+		return content;
+	}
+	for (size_t i = 0; i < files.gl_pathc; ++i) {
+		FILE* fp = ::fopen(files.gl_pathv[i], "r");
+		char buf[65536];
+		size_t n;
+		while (fp && (n = fread(buf, 1, sizeof buf, fp)) > 0) {
+			content.append(buf, n);
+		}
+		if (fp) {
+			::fclose(fp);
+		}
+	}
+	::globfree(&files);
+	return content;
+}
+
+static void removeLogFiles(const char* prefix)
+{
+	string pattern = string(prefix) + "*";
+	glob_t files;
+	if (::glob(pattern.c_str(), 0, NULL, &files) == 0) {
+		for (size_t i = 0; i < files.gl_pathc; ++i) {
+			::unlink(files.gl_pathv[i]);
+		}
+		::globfree(&files);
+	}
+}
+
+// 超过LogStream的4000字节、超过deferred字符串参数的64K、超过整个4MB buffer的日志都应该完整写入
+// mode: 0共享buffer，1线程私有缓冲区+无锁队列+零拷贝，2线程私有缓冲区+延迟格式化
+int test_asynclog_large(int mode) {
+
+	const int kSizes[] = { 10, 3990, 4500, 70000, 5 * 1000 * 1000 };
+	const int kRounds = 3;
+	const int kLines = kRounds * static_cast<int>(sizeof kSizes / sizeof kSizes[0]);
+
+	char logfile[128] = "async_log_large_";
+	removeLogFiles(logfile);
+	AsyncLogging log(logfile, 100 * 1000 * 1000, 1, 4000 * 1000, 8);
+	log.setThreadLocalBuffer(mode != 0);
+	if (mode == 1) {
+		log.setLockFreeQueue(16);
+		Logger::setOutput(asyncOutput, asyncReserve, asyncCommit);
+	} else {
+		Logger::setOutput(asyncOutput);
+	}
+	log.setDeferredFormatting(mode == 2);
+	Logger::setDeferredFormatting(mode == 2);
+	g_asyncLog = &log;
+	log.start();
+
+	for (int i = 0; i < kLines; i++) {
+		string payload(kSizes[i % (kLines / kRounds)], 'x');
+		LOG_INFO << "LARGE." << i << " " << payload;
+		LOG_INFO << "NO." << i << " Log Info Message!";
+	}
+
+	log.stop();
+	Logger::setDeferredFormatting(false);
+
+	// 每行都应该是"... LARGE.i xxx...x - 文件名:行号"
+	string content = readLogFiles(logfile);
+	int intact = 0;
+	size_t begin = 0;
+	while (begin < content.size()) {
+		size_t eol = content.find('\n', begin);
+		if (eol == string::npos) {
+			eol = content.size();
+		}
+		size_t mark = content.find("LARGE.", begin);
+		if (mark < eol) {
+			int i = atoi(content.c_str() + mark + 6);
+			size_t x = content.find(' ', mark) + 1;
+			size_t end = content.find_first_not_of('x', x);
+			if (end != string::npos && end - x == static_cast<size_t>(kSizes[i % (kLines / kRounds)]) &&
+			    content.compare(end, 3, " - ") == 0 && content.find(".cc:", end) < eol) {
+				++intact;
+			}
+		}
+		begin = eol + 1;
+	}
+
+	AsyncLogging::Stats stats = log.stats();
+	const char* names[] = { "shared buffer", "thread local buffer, zero copy", "thread local buffer, deferred formatting" };
+	cout << "large lines, " << names[mode] << ": " << intact << " of " << kLines << " intact, "
+	     << stats.appendedLines << " lines appended, " << stats.droppedBytes << " bytes dropped" << endl;
+	assert(intact == kLines);
+	assert(stats.appendedLines == 2 * kLines && stats.droppedBytes == 0);
+	removeLogFiles(logfile);
+
+	return 0;
+}
+
+// 进程占用的物理内存，KB
+static int64_t residentKB()
+{
+	long pages = 0;
+	FILE* fp = ::fopen("/proc/self/statm", "r");
+	if (fp) {
+		if (fscanf(fp, "%*s %ld", &pages) != 1) {
+			pages = 0;
+		}
+		::fclose(fp);
+	}
+	return static_cast<int64_t>(pages) * (::sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// 写一阵日志之后空闲3秒，后台线程只在写日志时醒来，空闲时不再每隔flushInterval秒醒一次
+// buffer用mmap分配，刚启动时几乎不占内存，空闲时写过的页也交还给内核
+int test_asynclog_idle(bool lockFree) {
+
+	int64_t before = residentKB();
+	char logfile[128] = "async_log_idle_";
+	AsyncLogging log(logfile, 1000 * 1000, 1);
+	if (lockFree) {
+		log.setLockFreeQueue(64);
+		log.setThreadLocalBuffer(true);
+	}
+	log.setReleaseIdleBuffers(true, false);
+	Logger::setOutput(asyncOutput);
+	g_asyncLog = &log;
+	log.start();
+	int64_t started = residentKB();
+
+	for (int i = 0; i < 200000; i++) {
+		LOG_INFO << "NO." << i << " Log Info Message!";
+	}
+	int64_t busy = residentKB();
+	::sleep(2);   // 等剩下的日志在flushInterval之后写入
+	int64_t wakeups = log.stats().backendWakeups;
+	::sleep(3);
+	int64_t idle = residentKB();
+	AsyncLogging::Stats stats = log.stats();
+	log.stop();
+
+	cout << "idle " << (lockFree ? "lock-free" : "shared") << ": " << wakeups << " wakeups writing 200000 lines, "
+	     << stats.backendWakeups - wakeups << " wakeups in 3s idle, "
+	     << stats.writtenBytes << " bytes written" << endl;
+	cout << "  resident: +" << started - before << "KB after start, +" << busy - before << "KB while logging, +"
+	     << idle - before << "KB idle" << endl;
+	assert(stats.backendWakeups == wakeups);
+	// MADV_DONTNEED马上交还，空闲时回到刚启动时的水平，留1MB给其他线程栈和堆的波动
+	assert(idle - started < 1024 && idle - started < (busy - started) / 2);
+	removeLogFiles(logfile);
+
+	return 0;
+}
+
+// 写日志线程自己的缺页次数
+static int64_t threadMinorFaults()
+{
+	struct rusage usage;
+	::getrusage(RUSAGE_THREAD, &usage);
+	return usage.ru_minflt;
+}
+
+// 单个生产者写日志时自己发生的缺页次数，返回缺页次数
+// pinned时buffer用透明大页、mlock并预先缺页，缺页发生在setBufferAllocation()中，生产者写buffer时不再缺页
+int64_t test_asynclog_faults(bool pinned) {
+
+	const int kLines = 200000;
+	const int kPoolBuffers = 16;
+	const size_t kBufferSize = 4 * 1024 * 1024;
+	char logfile[128] = "async_log_faults_";
+	AsyncLogging log(logfile, 1000 * 1000 * 1000, 1, kBufferSize, kPoolBuffers);
+	log.setOverflowPolicy(AsyncLogging::kBlock, 12 * 4 * 1024 * 1024);
+	if (pinned) {
+		detail::BufferAllocation alloc;
+		alloc.hugePages = detail::BufferAllocation::kTransparentHugePages;
+		alloc.lock = true;
+		alloc.prefault = true;
+		log.setBufferAllocation(alloc);
+	}
+	Logger::setOutput(asyncOutput);
+	g_asyncLog = &log;
+	log.start();
+
+	// 先写一行，让Logger用到的线程局部变量和格式化代码都已经缺过页
+	LOG_INFO << "warm up";
+	int64_t faults = threadMinorFaults();
+	for (int i = 0; i < kLines; i++) {
+		LOG_INFO << "NO." << i << " Log Info Message!";
+	}
+	faults = threadMinorFaults() - faults;
+	AsyncLogging::Stats stats = log.stats();
+	log.stop();
+	removeLogFiles(logfile);
+
+	cout << "faults " << (pinned ? "prefaulted, huge pages, mlock" : "lazy mmap") << ": "
+	     << faults << " producer minor faults in " << kLines << " lines, "
+	     << stats.hugePageAdvised << " huge page advised buffers, " << stats.lockedBuffers << " locked buffers, "
+	     << stats.emergencyAllocations << " emergency allocations" << endl;
+	if (pinned) {
+		// root或者RLIMIT_MEMLOCK够大时每个buffer都能mlock
+		const int kBuffers = kPoolBuffers + AsyncLogging::kHeldBuffers;
+		struct rlimit limit;
+		bool canLock = ::geteuid() == 0 ||
+		               (::getrlimit(RLIMIT_MEMLOCK, &limit) == 0 &&
+		                (limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur >= kBuffers * kBufferSize));
+		if (canLock) {
+			assert(stats.lockedBuffers == kBuffers);
+		}
+	}
+
+	return faults;
+}
+
+// 空闲的2MB大页个数，没有预留时为0
+static int64_t freeHugePages()
+{
+	int64_t pages = 0;
+	FILE* fp = ::fopen("/sys/kernel/mm/hugepages/hugepages-2048kB/free_hugepages", "r");
+	if (fp) {
+		if (fscanf(fp, "%" SCNd64, &pages) != 1) {
+			pages = 0;
+		}
+		::fclose(fp);
+	}
+	return pages;
+}
+
+// kHugeTlb：预留了大页时buffer都从大页分配；没有预留时跳过大页检查，只确认退回普通页后照常写日志
+int test_asynclog_hugetlb() {
+
+	const int kLines = 100000;
+	const int kBuffers = 4;
+	const size_t kBufferSize = 4 * 1024 * 1024;
+	char logfile[128] = "async_log_hugetlb_";
+	removeLogFiles(logfile);
+	int64_t freePages = freeHugePages();
+	AsyncLogging log(logfile, 1000 * 1000 * 1000, 1, kBufferSize, kBuffers);
+	detail::BufferAllocation alloc;
+	alloc.hugePages = detail::BufferAllocation::kHugeTlb;
+	log.setBufferAllocation(alloc);
+	Logger::setOutput(asyncOutput);
+	g_asyncLog = &log;
+	log.start();
+
+	for (int i = 0; i < kLines; i++) {
+		LOG_INFO << "NO." << i << " Log Info Message!";
+	}
+	log.stop();
+	AsyncLogging::Stats stats = log.stats();
+	int64_t lines = countLines(logfile);
+	removeLogFiles(logfile);
+
+	bool enough = freePages * static_cast<int64_t>(detail::AlignedBuffer::kHugePageSize) >=
+	              static_cast<int64_t>((kBuffers + 4) * kBufferSize);
+	cout << "hugetlb: " << freePages << " free huge pages, " << stats.hugePageAdvised
+	     << " huge page buffers, " << lines << " lines"
+	     << (freePages == 0 ? " (no huge pages reserved, huge page check skipped)" : "") << endl;
+	assert(lines == kLines);
+	if (freePages == 0) {
+		assert(stats.hugePageAdvised == 0);
+	} else if (enough) {
+		assert(stats.hugePageAdvised > 0);
+	}
+
+	return 0;
+}
+
+// 积压很多时限时stop()，超时没写完的日志计入丢弃
+// 格式化压在后台线程上，生产者结束时通常还积压着几十MB
+int test_asynclog_stop(double timeoutSeconds) {
+
+	off_t kRollSize = 1 * 1000 * 1000;	  // 只设置1M
+
+	char logfile[128] = "async_log_stop_";
+	AsyncLogging log(logfile, kRollSize, 1, 4000 * 1000, 32);
+	log.setOverflowPolicy(AsyncLogging::kBlock, 25 * 4000 * 1000);
+	log.setBlockTimeout(60);
+	// 不用deferred模式，写入的字节数和接受的字节数才能直接比较；
+	// 后台线程压缩每个buffer，比生产者慢得多，stop()时积压的远超期限内能写完的
+	log.setFrameCompression(6);
+	Logger::setOutput(asyncOutput);
+	g_asyncLog = &log;
+	log.start();
+
+	std::vector<std::unique_ptr<Thread>> threads;
+	for (int t = 0; t < THREAD_NUM; t++) {
+		threads.emplace_back(new Thread([] {
+			for (int i = 0; i < LOG_NUM / THREAD_NUM; i++) {
+				LOG_INFO << "NO." << i << " Log Info Message!";
+			}
+		}));
+		threads.back()->start();
+	}
+	for (auto& thr : threads) {
+		thr->join();
+	}
+
+	AsyncLogging::Stats before = log.stats();
+	AsyncLogging::StopReport report = log.stop(timeoutSeconds);
+	AsyncLogging::Stats after = log.stats();
+	cout << "stop(" << timeoutSeconds << "): " << before.pendingBytes << " bytes pending, "
+	     << report.flushedBytes << " bytes flushed, "
+	     << report.droppedBytes << " bytes dropped, " << (report.timedOut ? "timed out, " : "")
+	     << "need " << report.seconds << "(s)" << endl;
+	// 积压远超期限内能写完的量；stop()之前还没写的要么写入要么计入丢弃，
+	// 写入的字节数多出来的只有"Dropped log messages"那几行
+	assert(report.timedOut && report.droppedBytes > 0);
+	assert(report.flushedBytes + report.droppedBytes >= before.appendedBytes - before.writtenBytes);
+	assert(after.appendedBytes == before.appendedBytes);
+	assert(after.writtenBytes + after.droppedBytes >= after.appendedBytes &&
+	       after.writtenBytes + after.droppedBytes - after.appendedBytes < 4096);
+	assert(report.seconds < 5);
+	removeLogFiles(logfile);
+
+	return 0;
+}
+
+// 各分片的后台线程都因为压缩跟不上生产者，stop(timeoutSeconds)各分片同时停止，
+// 总共花的时间和一个分片差不多，没写完的计入丢弃
+int test_asynclog_sharded_stop(int shards, double timeoutSeconds) {
+
+	char logfile[128] = "async_log_shardstop_";
+	removeLogFiles(logfile);
+	ShardedAsyncLogging log(logfile, 1 * 1000 * 1000, shards, 1, 4000 * 1000);
+	log.setOverflowPolicy(AsyncLogging::kBlock, 25 * 4000 * 1000);
+	for (int i = 0; i < log.shards(); i++) {
+		log.shard(i).setBlockTimeout(60);
+		log.shard(i).setFrameCompression(6);
+	}
+	Logger::setOutput(shardedOutput);
+	g_shardedLog = &log;
+	log.start();
+
+	std::vector<std::unique_ptr<Thread>> threads;
+	for (int t = 0; t < THREAD_NUM; t++) {
+		threads.emplace_back(new Thread([t] {
+			ShardedAsyncLogging::setThreadChannel(t);
+			for (int i = 0; i < LOG_NUM / THREAD_NUM; i++) {
+				LOG_INFO << "NO." << i << " Log Info Message!";
+			}
+		}));
+		threads.back()->start();
+	}
+	for (auto& thr : threads) {
+		thr->join();
+	}
+
+	ShardedAsyncLogging::Stats before = log.stats();
+	ShardedAsyncLogging::StopReport report = log.stop(timeoutSeconds);
+	g_shardedLog = NULL;
+	cout << shards << " shards stop(" << timeoutSeconds << "): " << before.pendingBytes << " bytes pending, "
+	     << report.flushedBytes << " bytes flushed, " << report.droppedBytes << " bytes dropped, "
+	     << (report.timedOut ? "timed out, " : "") << "need " << report.seconds << "(s)" << endl;
+	assert(report.timedOut && report.droppedBytes > 0);
+	assert(report.flushedBytes + report.droppedBytes >= before.appendedBytes - before.writtenBytes);
+	assert(report.seconds < 5);
+	removeLogFiles(logfile);
+
+	return 0;
+}
+
+// 生产者一直在写的时候stop()：计入appendedLines的每一行都要在文件里，stop()之后的算作丢弃
+int test_asynclog_stop_race(const ThreadsOptions& opt, const char* name) {
+
+	const int kRounds = 20;
+	char logfile[128] = "async_log_stoprace_";
+	int64_t appended = 0;
+	int64_t written = 0;
+	for (int round = 0; round < kRounds; round++) {
+		removeLogFiles(logfile);
+		AsyncLogging log(logfile, 1000 * 1000 * 1000, 1, 64 * 1024, 8);
+		// 积压不设限，stop()之前不丢日志
+		log.setOverflowPolicy(AsyncLogging::kDropNewest, 1024 * 1024 * 1024);
+		log.setThreadLocalBuffer(opt.threadLocal);
+		if (opt.queueSlots > 0) {
+			log.setLockFreeQueue(opt.queueSlots);
+		}
+		if (opt.zeroCopy) {
+			Logger::setOutput(asyncOutput, asyncReserve, asyncCommit);
+		} else {
+			Logger::setOutput(asyncOutput);
+		}
+		g_asyncLog = &log;
+		log.start();
+
+		std::atomic<bool> done(false);
+		std::vector<std::unique_ptr<Thread>> threads;
+		for (int t = 0; t < THREAD_NUM; t++) {
+			threads.emplace_back(new Thread([&done] {
+				for (int i = 0; !done.load(std::memory_order_relaxed); i++) {
+					LOG_INFO << "NO." << i << " Log Info Message!";
+				}
+			}));
+			threads.back()->start();
+		}
+		usleep(20 * 1000);
+		log.stop();
+		usleep(1000);
+		done = true;
+		for (auto& thr : threads) {
+			thr->join();
+		}
+
+		AsyncLogging::Stats stats = log.stats();
+		int64_t lines = countLinesWith(logfile, " Log Info Message!");
+		appended += stats.appendedLines;
+		written += lines;
+		assert(stats.appendedLines == lines);
+		assert(stats.droppedBytes > 0);
+	}
+	Logger::setOutput(asyncOutput);
+	removeLogFiles(logfile);
+	cout << "stop race, " << name << ": " << appended << " lines appended, "
+	     << written << " lines in files over " << kRounds << " rounds" << endl;
+
+	return 0;
+}
+
+static std::atomic<bool> g_inSlowCall(false);
+
+static int slowCall()
+{
+	g_inSlowCall = true;
+	usleep(500 * 1000);
+	return 0;
+}
+
+// 零拷贝写入时一行日志格式化期间一直占着预留的空间，stop(0.01)不能等用户代码执行完
+int test_asynclog_stop_reserved() {
+
+	char logfile[128] = "async_log_reserved_";
+	removeLogFiles(logfile);
+	AsyncLogging log(logfile, 1000 * 1000 * 1000, 30);
+	log.setThreadLocalBuffer(true);
+	Logger::setOutput(asyncOutput, asyncReserve, asyncCommit);
+	g_asyncLog = &log;
+	log.start();
+
+	g_inSlowCall = false;
+	Thread thread([] {
+		for (int i = 0; i < 1000; i++) {
+			LOG_INFO << "NO." << i << " Log Info Message!";
+		}
+		LOG_INFO << "slow " << slowCall();
+	});
+	thread.start();
+	while (!g_inSlowCall) {
+		usleep(1000);
+	}
+	AsyncLogging::StopReport report = log.stop(0.01);
+	thread.join();
+	Logger::setOutput(asyncOutput);
+	int64_t lines = countLines(logfile);
+	int64_t slowLines = countLinesWith(logfile, "slow");
+	removeLogFiles(logfile);
+
+	cout << "stop(0.01) with open reservation: " << report.seconds << "(s), "
+	     << (report.timedOut ? "timed out, " : "") << report.droppedBytes << " bytes dropped, "
+	     << lines << " lines written" << endl;
+	assert(report.seconds < 0.2 && report.timedOut && report.droppedBytes > 0);
+	assert(slowLines == 0);
+
+	return 0;
+}
+
+// 后台线程格式化并以最高级别压缩，4个生产者只拷贝参数，积压上限只有2个1MB的buffer，
+// 后台线程一定跟不上，按policy丢弃或等待；每1000行有一行WARN，一共不到kHighLevelHeadroom留出的空间
+int test_asynclog_overflow(AsyncLogging::OverflowPolicy policy, const char* name) {
+
+	off_t kRollSize = 1 * 1000 * 1000;	  // 只设置1M
+	const int kBufferSize = 1000 * 1000;
+
+	char logfile[128] = "async_log_overflow_";
+	removeLogFiles(logfile);
+	AsyncLogging log(logfile, kRollSize, 1, kBufferSize, 8);
+	log.setOverflowPolicy(policy, 2 * kBufferSize);
+	log.setBlockTimeout(60);
+	log.setDropLevel(Logger::WARN);
+	log.setDeferredFormatting(true);
+	log.setFrameCompression(9);
+	Logger::setDeferredFormatting(true);
+	Logger::setOutput(asyncOutput);
+	g_asyncLog = &log;
+	log.start();
+
+	Timestamp begin_time = Timestamp::now();
+
+	std::vector<std::unique_ptr<Thread>> threads;
+	for (int t = 0; t < THREAD_NUM; t++) {
+		threads.emplace_back(new Thread([] {
+			for (int i = 0; i < LOG_NUM / THREAD_NUM; i++) {
+				if (i % 1000 == 0) {
+					LOG_WARN << "NO." << i << " Log Warn Message!";
+				} else {
+					LOG_INFO << "NO." << i << " Log Info Message!";
+				}
+			}
+		}));
+		threads.back()->start();
+	}
+	for (auto& thr : threads) {
+		thr->join();
+	}
+	// 最新的一行，kDropOldest时一定会写入
+	LOG_WARN << "Overflow test end";
+
+	log.stop();
+	Logger::setDeferredFormatting(false);
+
+	Timestamp end_time = Timestamp::now();
+	double consume_time = timeDifference(end_time, begin_time);
+
+	AsyncLogging::Stats stats = log.stats();
+	OrderCheck check = checkThreadOrder(logfile, THREAD_NUM, LOG_NUM / THREAD_NUM);
+	int64_t warnLines = countLinesWith(logfile, " WARN ");
+	int64_t endLines = countLinesWith(logfile, "Overflow test end");
+	removeLogFiles(logfile);
+
+	cout << "overflow policy " << name << ", " << THREAD_NUM << " threads: need "
+	     << consume_time << "(s)  ops:" <<  (LOG_NUM / (consume_time)) << "/s" << endl;
+	cout << "  stats: " << stats.appendedLines << " lines " << stats.appendedBytes << " bytes appended, "
+	     << stats.writtenBytes << " bytes written, " << stats.droppedBytes << " bytes dropped, "
+	     << stats.emergencyAllocations << " emergency allocations, " << stats.rolls << " rolls, "
+	     << "last flush " << stats.lastFlush.toFormattedString() << endl;
+	cout << "  files: " << check.lines << " lines, " << warnLines << " WARN lines" << endl;
+
+	switch (policy) {
+	case AsyncLogging::kDropNewest:
+		// 接受了的都写入了
+		assert(stats.droppedBytes > 0);
+		assert(stats.appendedLines < LOG_NUM && check.lines + endLines == stats.appendedLines);
+		break;
+	case AsyncLogging::kDropOldest:
+		// 都接受了，之后丢弃的是最旧的buffer，最新的一行还在
+		assert(stats.droppedBytes > 0 && stats.appendedLines == LOG_NUM + 1);
+		assert(check.lines < LOG_NUM && endLines == 1);
+		break;
+	case AsyncLogging::kBlock:
+		assert(stats.droppedBytes == 0 && stats.appendedLines == LOG_NUM + 1);
+		assert(check.lines == LOG_NUM && check.complete && check.violations == 0 && endLines == 1);
+		break;
+	case AsyncLogging::kDropBelowLevel:
+		// 即使后台线程一点都没写，所有WARN也放得下，一行都不丢
+		assert(stats.droppedBytes > 0);
+		assert(check.lines + endLines == stats.appendedLines && check.lines < LOG_NUM);
+		assert(warnLines == LOG_NUM / 1000 + 1 && endLines == 1);
+		break;
+	}
+
+	return 0;
+}
+
+// 按decodeLogFile()还原prefix开头的日志文件，统计包含needle的行数
+static int64_t countLinesWith(const char* prefix, const char* needle)
+{
+	string pattern = string(prefix) + "*";
+	glob_t files;
+	int64_t lines = 0;
+	if (::glob(pattern.c_str(), 0, NULL, &files) != 0) {
+		return 0;
+	}
+	for (size_t i = 0; i < files.gl_pathc; ++i) {
+		string content = decodeLogFile(files.gl_pathv[i]);
+		const char* p = content.c_str();
+		const char* end = p + content.size();
+		while (p < end) {
+			const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+			if (!eol) {
+				eol = end;
+			}
+			lines += ::memmem(p, eol - p, needle, strlen(needle)) != NULL;
+			p = eol + 1;
+		}
+	}
+	::globfree(&files);
+	return lines;
+}
+
+// 统计文件名以prefix开头的日志文件的总行数
+static int64_t countLines(const char* prefix)
+{
+	string pattern = string(prefix) + "*";
+	glob_t files;
+	int64_t lines = 0;
+	if (::glob(pattern.c_str(), 0, NULL, &files) != 0) {
+		return 0;
+	}
+	for (size_t i = 0; i < files.gl_pathc; ++i) {
+		FILE* fp = ::fopen(files.gl_pathv[i], "r");
+		int c;
+		while (fp && (c = getc(fp)) != EOF) {
+			lines += c == '\n';
+		}
+		if (fp) {
+			::fclose(fp);
+		}
+	}
+	::globfree(&files);
+	return lines;
+}
+
+// 子进程写完日志后LOG_FATAL或者收到SIGSEGV，崩溃前写入的日志都应该在文件中
+int test_asynclog_crash(bool signal) {
+
+	const int kLines = 10000;
+	const char* logfile = signal ? "async_log_signal_" : "async_log_fatal_";
+	pid_t pid = ::fork();
+	if (pid == 0) {
+		// flush间隔很长，崩溃之前后台线程不会写文件
+		AsyncLogging log(logfile, 1000 * 1000 * 1000, 30);
+		log.enableCrashDrain(1.0, true);
+		Logger::setOutput(asyncOutput);
+		g_asyncLog = &log;
+		log.start();
+		for (int i = 0; i < kLines; i++) {
+			LOG_INFO << "NO." << i << " Log Info Message!";
+		}
+		if (signal) {
+			::raise(SIGSEGV);
+		} else {
+			LOG_FATAL << "NO." << kLines << " Log Fatal Message!";
+		}
+		::_exit(0);
+	}
+
+	int status = 0;
+	::waitpid(pid, &status, 0);
+	cout << (signal ? "SIGSEGV" : "LOG_FATAL") << " crash drain: child "
+	     << (WIFSIGNALED(status) ? "killed by signal " : "exited ")
+	     << (WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status))
+	     << ", " << countLines(logfile) << " of " << (signal ? kLines : kLines + 1)
+	     << " lines written" << endl;
+	assert(countLines(logfile) == (signal ? kLines : kLines + 1));
+	removeLogFiles(logfile);
+
+	return 0;
+}
+
+static int g_appFlushes = 0;
+
+static void appFlush()
+{
+	++g_appFlushes;
+}
+
+static void appSegvHandler(int)
+{
+	::_exit(42);
+}
+
+// 应用自己的flush函数和SIGSEGV处理函数：开启期间先写日志再交给它们，stop()之后恢复原样
+int test_asynclog_crash_chain() {
+
+	const int kLines = 10000;
+	const char* logfile = "async_log_chain_";
+	removeLogFiles(logfile);
+	Logger::FlushFunc defaultFlush = Logger::flushFunc();
+	struct sigaction sa, old;
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = appSegvHandler;
+	sigemptyset(&sa.sa_mask);
+	::sigaction(SIGSEGV, &sa, &old);
+	Logger::setFlush(appFlush);
+
+	{
+		AsyncLogging log(logfile, 1000 * 1000 * 1000, 30);
+		log.enableCrashDrain(1.0, true);
+		assert(Logger::flushFunc() != appFlush);
+		log.start();
+		log.stop();
+		struct sigaction now;
+		::sigaction(SIGSEGV, NULL, &now);
+		assert(Logger::flushFunc() == appFlush && now.sa_handler == appSegvHandler);
+	}
+
+	pid_t pid = ::fork();
+	if (pid == 0) {
+		AsyncLogging log(logfile, 1000 * 1000 * 1000, 30);
+		log.enableCrashDrain(1.0, true);
+		Logger::setOutput(asyncOutput);
+		g_asyncLog = &log;
+		log.start();
+		for (int i = 0; i < kLines; i++) {
+			LOG_INFO << "NO." << i << " Log Info Message!";
+		}
+		::raise(SIGSEGV);
+		::_exit(0);
+	}
+
+	int status = 0;
+	::waitpid(pid, &status, 0);
+	int64_t lines = countLines((string(logfile) + ".crash.").c_str());
+	cout << "chained SIGSEGV crash drain: child "
+	     << (WIFEXITED(status) ? "exited " : "killed by signal ")
+	     << (WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status))
+	     << ", " << lines << " of " << kLines << " lines in crash file" << endl;
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 42);
+	assert(lines == kLines);
+	removeLogFiles(logfile);
+
+	::sigaction(SIGSEGV, &old, NULL);
+	Logger::setFlush(defaultFlush);
+
+	return 0;
+}
+
 int main() {
 
 	test_asynclog();
+	test_asynclog_thread_churn();
+	test_asynclog_channel_switch();
+	test_asynclog_threads(ThreadsOptions());
+	test_asynclog_threads(ThreadsOptions().setThreadLocal());
+	test_asynclog_threads(ThreadsOptions().setQueueSlots(16));
+	test_asynclog_threads(ThreadsOptions().setThreadLocal().setQueueSlots(16));
+	test_asynclog_threads(ThreadsOptions().setIoUring(8));
+	test_asynclog_threads(ThreadsOptions().setThreadLocal().setQueueSlots(16).setIoUring(8));
+	test_asynclog_threads(ThreadsOptions().setQueueSlots(16).setDirectIo());
+	test_asynclog_threads(ThreadsOptions().setThreadLocal().setQueueSlots(16).setDeferred());
+	test_asynclog_threads(ThreadsOptions().setThreadLocal().setQueueSlots(16).setBinary());
+	test_asynclog_threads(ThreadsOptions().setThreadLocal().setQueueSlots(16).setCompression(1));
+	test_asynclog_threads(ThreadsOptions().setThreadLocal().setZeroCopy());
+	test_asynclog_threads(ThreadsOptions().setThreadLocal().setQueueSlots(16).setZeroCopy());
+	test_asynclog_overflow(AsyncLogging::kDropNewest, "drop newest");
+	test_asynclog_overflow(AsyncLogging::kDropOldest, "drop oldest");
+	test_asynclog_overflow(AsyncLogging::kBlock, "block");
+	test_asynclog_overflow(AsyncLogging::kDropBelowLevel, "drop below WARN");
+	test_asynclog_direct_tail();
+	test_asynclog_preallocate();
+	test_asynclog_drop_cache();
+	test_asynclog_compression();
+	test_asynclog_binary_args();
+	test_latency_histogram();
+	test_asynclog_latency(false);
+	test_asynclog_latency(true);
+	test_asynclog_large(0);
+	test_asynclog_large(1);
+	test_asynclog_large(2);
+	test_asynclog_sharded(4);
+	test_asynclog_idle(false);
+	test_asynclog_idle(true);
+	int64_t lazyFaults = test_asynclog_faults(false);
+	int64_t pinnedFaults = test_asynclog_faults(true);
+	assert(lazyFaults > 0 && pinnedFaults * 10 < lazyFaults);
+	test_asynclog_hugetlb();
+	test_asynclog_stop(0.001);
+	test_asynclog_stop_reserved();
+	test_asynclog_sharded_stop(4, 0.001);
+	test_asynclog_stop_race(ThreadsOptions(), "shared buffer");
+	test_asynclog_stop_race(ThreadsOptions().setThreadLocal(), "thread local buffer");
+	test_asynclog_stop_race(ThreadsOptions().setThreadLocal().setQueueSlots(16), "thread local buffer, lock-free queue");
+	test_asynclog_stop_race(ThreadsOptions().setThreadLocal().setZeroCopy(), "thread local buffer, zero copy");
+	test_asynclog_crash(false);
+	test_asynclog_crash(true);
+	test_asynclog_crash_chain();
 
 	return 0;
 }